@@ -0,0 +1,81 @@
+/*
+ * bench_report.cpp
+ *
+ * Copyright (C) 2026 Kristofer Berggren
+ * All rights reserved.
+ *
+ * heapusage is distributed under the BSD 3-Clause license, see LICENSE for details.
+ *
+ */
+
+/*
+ * Measures time to output a leak report with a large number of unique call
+ * sites, dominated by symbolization. Compare against a run with symbol lookup
+ * disabled (-n) to get the symbolization cost.
+ *
+ * Usage: heapusage -t leak -o /dev/null ./bench_report
+ */
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+#include "heapusage.h"
+
+#define BENCH_OUTER 40
+#define BENCH_INNER 50
+
+static std::vector<void*>* leaks = nullptr;
+
+template <int A, int B>
+struct bench_site
+{
+  static void __attribute__((noinline)) run()
+  {
+    leaks->push_back(malloc((A * BENCH_INNER) + B + 1));
+    bench_site<A, B - 1>::run();
+  }
+};
+
+template <int A>
+struct bench_site<A, 0>
+{
+  static void __attribute__((noinline)) run()
+  {
+    leaks->push_back(malloc((A * BENCH_INNER) + 1));
+  }
+};
+
+template <int A>
+struct bench_outer
+{
+  static void __attribute__((noinline)) run()
+  {
+    bench_site<A, BENCH_INNER - 1>::run();
+    bench_outer<A - 1>::run();
+  }
+};
+
+template <>
+struct bench_outer<-1>
+{
+  static void run()
+  {
+  }
+};
+
+int main()
+{
+  leaks = new std::vector<void*>();
+  leaks->reserve(BENCH_OUTER * BENCH_INNER);
+  bench_outer<BENCH_OUTER - 1>::run();
+
+  auto start = std::chrono::steady_clock::now();
+  hu_report();
+  auto end = std::chrono::steady_clock::now();
+
+  printf("%zu leak sites, report: %lld ms\n", leaks->size(),
+         (long long)std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count());
+  return 0;
+}
@@ -0,0 +1,68 @@
+/*
+ * bench_unwind.cpp
+ *
+ * Copyright (C) 2026 Kristofer Berggren
+ * All rights reserved.
+ *
+ * heapusage is distributed under the BSD 3-Clause license, see LICENSE for details.
+ *
+ */
+
+/*
+ * Measures per-call cost of the backtrace() and frame pointer unwinders,
+ * capturing 8, 20 and 64 frames from a call chain deeper than that.
+ *
+ * Usage: bench_unwind [iterations]
+ */
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+
+#include "huunwind.h"
+
+#define BENCH_CHAIN_DEPTH 80
+
+static volatile int sink = 0;
+
+static void __attribute__((noinline)) bench_run(bool fp, int depth, int iterations)
+{
+  void* callstack[64];
+  hu_unwind_init(fp);
+
+  auto start = std::chrono::steady_clock::now();
+  int frames = 0;
+  for (int i = 0; i < iterations; ++i)
+  {
+    frames = hu_unwind(callstack, depth);
+    sink += frames;
+  }
+  auto end = std::chrono::steady_clock::now();
+
+  double ns = std::chrono::duration<double, std::nano>(end - start).count() / iterations;
+  printf("%-10s depth %2d: %8.1f ns/call (%d frames)\n", fp ? "fp" : "backtrace", depth, ns, frames);
+}
+
+static int __attribute__((noinline)) bench_chain(int level, int iterations)
+{
+  if (level > 0)
+  {
+    /* Not a tail call, keeping one real frame per level */
+    return bench_chain(level - 1, iterations) + sink;
+  }
+
+  const int depths[] = { 8, 20, 64 };
+  for (int depth : depths)
+  {
+    bench_run(false, depth, iterations);
+    bench_run(true, depth, iterations);
+  }
+
+  return 0;
+}
+
+int main(int argc, char** argv)
+{
+  int iterations = (argc > 1) ? atoi(argv[1]) : 100000;
+  return bench_chain(BENCH_CHAIN_DEPTH, iterations);
+}
@@ -0,0 +1,475 @@
+/*
+ * huanalyze.cpp
+ *
+ * Copyright (C) 2026 Kristofer Berggren
+ * All rights reserved.
+ *
+ * heapusage is distributed under the BSD 3-Clause license, see LICENSE for details.
+ *
+ */
+
+/* ----------- Includes ------------------------------------------ */
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "hulog.h"
+#include "hutrace.h"
+
+
+/* ----------- Defines ------------------------------------------- */
+#define HU_LIFETIME_BUCKETS 8   /* Decades from below 1 us to 1 s and above */
+
+
+/* ----------- Types --------------------------------------------- */
+struct hu_heap_event
+{
+  uint64_t time;
+  uint64_t ptr;
+  uint64_t size;
+  uint32_t stack_id;
+  uint32_t thread;
+  int type;
+};
+
+struct hu_module
+{
+  uint64_t start;
+  uint64_t end;
+  uint64_t base;
+  std::string build_id;
+  std::string path;
+};
+
+struct hu_live_block
+{
+  uint64_t size;
+  uint64_t time;
+  uint32_t stack_id;
+};
+
+struct hu_site
+{
+  uint32_t stack_id = 0;
+  unsigned long long allocs = 0;
+  unsigned long long alloc_bytes = 0;
+  unsigned long long frees = 0;
+  unsigned long long lifetime_total = 0;
+  unsigned long long live_blocks = 0;
+  unsigned long long live_bytes = 0;
+};
+
+struct hu_trace
+{
+  std::vector<hu_heap_event> events;
+  std::map<uint32_t, std::vector<uint64_t>> stacks;
+  std::vector<hu_module> modules;
+  uint32_t threads = 0;
+  bool truncated = false;
+};
+
+
+/* ----------- Local Functions ----------------------------------- */
+static void showusage()
+{
+  std::cout <<
+    "heapusage-analyze reports leaks, peak usage, block lifetimes and hot\n"
+    "allocation sites from a trace recorded with heapusage -t trace.\n"
+    "\n"
+    "Usage: heapusage-analyze [-k count] FILE\n"
+    "   or: heapusage-analyze --help\n"
+    "\n"
+    "Options:\n"
+    "   -k <count>      number of top sites to report (default 10)\n"
+    "   FILE            trace file to analyze, report is written to stdout\n"
+    "   -h,--help       display this help and exit\n"
+    "\n"
+    "Example:\n"
+    "heapusage -t trace ./ex001 && heapusage-analyze heapusage.trace\n"
+    "   record trace of heap operations, and analyze it afterwards.\n"
+    "\n"
+    "Report bugs at https://github.com/d99kris/heapusage\n"
+    "\n";
+}
+
+static bool hu_get(const std::vector<unsigned char>& data, size_t& pos, uint64_t& value)
+{
+  value = 0;
+  for (int shift = 0; (pos < data.size()) && (shift < 64); shift += 7)
+  {
+    const unsigned char byte = data[pos++];
+    value |= (uint64_t)(byte & 0x7f) << shift;
+    if (!(byte & 0x80)) return true;
+  }
+
+  return false;
+}
+
+static bool hu_get_string(const std::vector<unsigned char>& data, size_t& pos, std::string& value)
+{
+  uint64_t len = 0;
+  if (!hu_get(data, pos, len) || (len > (data.size() - pos))) return false;
+
+  value.assign((const char*)&data[pos], len);
+  pos += len;
+  return true;
+}
+
+static bool hu_parse_record(const std::vector<unsigned char>& data, size_t& pos, hu_trace& trace,
+                            std::unordered_map<uint32_t, uint64_t>& thread_times)
+{
+  const int type = data[pos++];
+  uint64_t values[4] = { 0 };
+  switch (type)
+  {
+    case EVENT_MALLOC:
+    case EVENT_CALLOC:
+    case EVENT_REALLOC:
+    case EVENT_FREE:
+    {
+      hu_heap_event event;
+      uint64_t thread = 0;
+      uint64_t delta = 0;
+      if (!hu_get(data, pos, thread) || !hu_get(data, pos, delta) || !hu_get(data, pos, event.ptr)) return false;
+
+      event.size = 0;
+      event.stack_id = 0;
+      if (type != EVENT_FREE)
+      {
+        if (!hu_get(data, pos, event.size) || !hu_get(data, pos, values[0])) return false;
+
+        event.stack_id = (uint32_t)values[0];
+      }
+
+      event.type = type;
+      event.thread = (uint32_t)thread;
+      event.time = (thread_times[event.thread] += delta);
+      trace.threads = std::max(trace.threads, event.thread + 1);
+      trace.events.push_back(event);
+      return true;
+    }
+
+    case HU_TRACE_REC_STACK:
+    {
+      if (!hu_get(data, pos, values[0]) || !hu_get(data, pos, values[1]) || (values[1] > MAX_CALL_STACK)) return false;
+
+      std::vector<uint64_t> frames(values[1]);
+      for (uint64_t& frame : frames)
+      {
+        if (!hu_get(data, pos, frame)) return false;
+      }
+
+      trace.stacks[(uint32_t)values[0]] = frames;
+      return true;
+    }
+
+    case HU_TRACE_REC_MODULE:
+    {
+      hu_module module;
+      if (!hu_get(data, pos, module.start) || !hu_get(data, pos, module.end) || !hu_get(data, pos, module.base) ||
+          !hu_get_string(data, pos, module.build_id) || !hu_get_string(data, pos, module.path)) return false;
+
+      trace.modules.push_back(module);
+      return true;
+    }
+
+    default:
+      return false;
+  }
+}
+
+static bool hu_load_trace(const char* path, hu_trace& trace)
+{
+  std::ifstream file(path, std::ios::binary);
+  if (!file.is_open())
+  {
+    std::cerr << "heapusage-analyze: unable to open " << path << "\n";
+    return false;
+  }
+
+  std::vector<unsigned char> data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+  if ((data.size() < HU_TRACE_MAGIC_LEN) || (memcmp(data.data(), HU_TRACE_MAGIC, HU_TRACE_MAGIC_LEN) != 0))
+  {
+    std::cerr << "heapusage-analyze: " << path << " is not a heapusage trace\n";
+    return false;
+  }
+
+  std::unordered_map<uint32_t, uint64_t> thread_times;
+  size_t pos = HU_TRACE_MAGIC_LEN;
+  while (pos < data.size())
+  {
+    if (!hu_parse_record(data, pos, trace, thread_times))
+    {
+      /* Typically a process that did not exit normally */
+      trace.truncated = true;
+      break;
+    }
+  }
+
+  /* Threads' events are each in order, merge them by time */
+  std::stable_sort(trace.events.begin(), trace.events.end(),
+                   [](const hu_heap_event& lhs, const hu_heap_event& rhs) { return lhs.time < rhs.time; });
+  return true;
+}
+
+static void hu_print_stack(const hu_trace& trace, uint32_t stack_id)
+{
+  auto it = trace.stacks.find(stack_id);
+  if ((it == trace.stacks.end()) || (it->second.size() < 2))
+  {
+    printf("   (no call stack, block below minimum size)\n");
+    return;
+  }
+
+  /* First frame is within heapusage, as in its reports */
+  for (size_t i = 1; i < it->second.size(); ++i)
+  {
+    printf("   at 0x%016" PRIx64 "\n", it->second[i]);
+  }
+}
+
+static std::string hu_format_time(uint64_t ns)
+{
+  char str[32];
+  snprintf(str, sizeof(str), "%.3f s", ns / 1e9);
+  return std::string(str);
+}
+
+/*
+ * hu_replay applies events up to (not including) index end, updating live
+ * blocks and per site statistics. Returns index of the event reaching peak
+ * heap usage.
+ */
+static size_t hu_replay(const hu_trace& trace, size_t end, std::unordered_map<uint64_t, hu_live_block>& live,
+                        std::unordered_map<uint32_t, hu_site>& sites, unsigned long long lifetimes[],
+                        unsigned long long& current, unsigned long long& peak)
+{
+  size_t peak_index = 0;
+  for (size_t i = 0; i < end; ++i)
+  {
+    const hu_heap_event& event = trace.events[i];
+    auto it = live.find(event.ptr);
+    if (it != live.end())
+    {
+      /* Free, or allocation of a block whose free was not seen */
+      hu_site& site = sites[it->second.stack_id];
+      const uint64_t lifetime = event.time - it->second.time;
+      site.frees += 1;
+      site.lifetime_total += lifetime;
+      site.live_blocks -= 1;
+      site.live_bytes -= it->second.size;
+      current -= it->second.size;
+
+      int bucket = 0;
+      for (uint64_t limit = 1000; (lifetime >= limit) && (bucket < (HU_LIFETIME_BUCKETS - 1)); limit *= 10)
+      {
+        ++bucket;
+      }
+
+      lifetimes[bucket] += 1;
+      live.erase(it);
+    }
+
+    if (event.type != EVENT_FREE)
+    {
+      hu_live_block& block = live[event.ptr];
+      block.size = event.size;
+      block.time = event.time;
+      block.stack_id = event.stack_id;
+
+      hu_site& site = sites[event.stack_id];
+      site.stack_id = event.stack_id;
+      site.allocs += 1;
+      site.alloc_bytes += event.size;
+      site.live_blocks += 1;
+      site.live_bytes += event.size;
+      current += event.size;
+      if (current > peak)
+      {
+        peak = current;
+        peak_index = i;
+      }
+    }
+  }
+
+  return peak_index;
+}
+
+static std::vector<hu_site> hu_sorted_sites(const std::unordered_map<uint32_t, hu_site>& sites,
+                                            unsigned long long hu_site::* key)
+{
+  std::vector<hu_site> sorted;
+  for (const auto& site : sites)
+  {
+    if (site.second.*key > 0)
+    {
+      sorted.push_back(site.second);
+    }
+  }
+
+  std::sort(sorted.begin(), sorted.end(),
+            [key](const hu_site& lhs, const hu_site& rhs) { return lhs.*key > rhs.*key; });
+  return sorted;
+}
+
+
+/* ----------- Global Functions ---------------------------------- */
+int main(int argc, char* argv[])
+{
+  size_t top = 10;
+  const char* path = nullptr;
+  for (int i = 1; i < argc; ++i)
+  {
+    if ((strcmp(argv[i], "-h") == 0) || (strcmp(argv[i], "--help") == 0))
+    {
+      showusage();
+      return 0;
+    }
+    else if ((strcmp(argv[i], "-k") == 0) && ((i + 1) < argc))
+    {
+      top = strtoull(argv[++i], nullptr, 10);
+    }
+    else
+    {
+      path = argv[i];
+    }
+  }
+
+  if (path == nullptr)
+  {
+    showusage();
+    return 1;
+  }
+
+  hu_trace trace;
+  if (!hu_load_trace(path, trace)) return 1;
+
+  if (trace.truncated)
+  {
+    std::cerr << "heapusage-analyze: trace truncated, analyzing " << trace.events.size() << " events\n";
+  }
+
+  /* Replay all events, then again up to peak for sites live at peak */
+  std::unordered_map<uint64_t, hu_live_block> live;
+  std::unordered_map<uint32_t, hu_site> sites;
+  unsigned long long lifetimes[HU_LIFETIME_BUCKETS] = { 0 };
+  unsigned long long current = 0;
+  unsigned long long peak = 0;
+  const size_t peak_index = hu_replay(trace, trace.events.size(), live, sites, lifetimes, current, peak);
+
+  std::unordered_map<uint64_t, hu_live_block> peak_live;
+  std::unordered_map<uint32_t, hu_site> peak_sites;
+  unsigned long long peak_lifetimes[HU_LIFETIME_BUCKETS] = { 0 };
+  unsigned long long peak_current = 0;
+  unsigned long long peak_peak = 0;
+  if (!trace.events.empty())
+  {
+    hu_replay(trace, peak_index + 1, peak_live, peak_sites, peak_lifetimes, peak_current, peak_peak);
+  }
+
+  unsigned long long allocs = 0;
+  unsigned long long frees = 0;
+  unsigned long long alloc_bytes = 0;
+  for (const hu_heap_event& event : trace.events)
+  {
+    if (event.type == EVENT_FREE)
+    {
+      ++frees;
+    }
+    else
+    {
+      ++allocs;
+      alloc_bytes += event.size;
+    }
+  }
+
+  const uint64_t duration = trace.events.empty() ? 0 : trace.events.back().time;
+  const uint64_t peak_time = trace.events.empty() ? 0 : trace.events[peak_index].time;
+
+  printf("Heapusage trace analysis - https://github.com/d99kris/heapusage\n");
+  printf("Trace: %s\n", path);
+  printf("\n");
+
+  printf("TRACE SUMMARY:\n");
+  printf("            events: %zu over %s\n", trace.events.size(), hu_format_time(duration).c_str());
+  printf("           threads: %u\n", trace.threads);
+  printf("      unique sites: %zu\n", trace.stacks.size());
+  printf("\n");
+
+  printf("HEAP SUMMARY:\n");
+  printf("    in use at exit: %llu bytes in %zu blocks\n", current, live.size());
+  printf("  total heap usage: %llu allocs, %llu frees, %llu bytes allocated\n", allocs, frees, alloc_bytes);
+  printf("   peak heap usage: %llu bytes allocated, at %s\n", peak, hu_format_time(peak_time).c_str());
+  printf("\n");
+
+  static const char* lifetime_labels[HU_LIFETIME_BUCKETS] =
+  {
+    "< 1 us", "< 10 us", "< 100 us", "< 1 ms", "< 10 ms", "< 100 ms", "< 1 s", ">= 1 s"
+  };
+  printf("LIFETIME SUMMARY:\n");
+  for (int i = 0; i < HU_LIFETIME_BUCKETS; ++i)
+  {
+    printf("   %15s: %llu blocks\n", lifetime_labels[i], lifetimes[i]);
+  }
+  printf("   %15s: %zu blocks\n", "never freed", live.size());
+  printf("\n");
+
+  const std::vector<hu_site> hot_sites = hu_sorted_sites(sites, &hu_site::allocs);
+  printf("TOP %zu ALLOCATION SITES BY COUNT:\n", std::min(top, hot_sites.size()));
+  for (size_t i = 0; i < std::min(top, hot_sites.size()); ++i)
+  {
+    const hu_site& site = hot_sites[i];
+    const unsigned long long mean_lifetime = (site.frees > 0) ? (site.lifetime_total / site.frees) : 0;
+    printf("%llu allocs, %llu bytes, %llu frees with mean lifetime %llu ns, allocated at:\n", site.allocs,
+           site.alloc_bytes, site.frees, mean_lifetime);
+    hu_print_stack(trace, site.stack_id);
+    printf("\n");
+  }
+
+  const std::vector<hu_site> peak_top_sites = hu_sorted_sites(peak_sites, &hu_site::live_bytes);
+  printf("TOP %zu SITES AT PEAK:\n", std::min(top, peak_top_sites.size()));
+  for (size_t i = 0; i < std::min(top, peak_top_sites.size()); ++i)
+  {
+    const hu_site& site = peak_top_sites[i];
+    printf("%llu bytes in %llu block(s) in use at peak, allocated at:\n", site.live_bytes, site.live_blocks);
+    hu_print_stack(trace, site.stack_id);
+    printf("\n");
+  }
+
+  const std::vector<hu_site> leak_sites = hu_sorted_sites(sites, &hu_site::live_bytes);
+  for (const hu_site& site : leak_sites)
+  {
+    printf("%llu bytes in %llu block(s) are lost, originally allocated at:\n", site.live_bytes, site.live_blocks);
+    hu_print_stack(trace, site.stack_id);
+    printf("\n");
+  }
+
+  printf("LEAK SUMMARY:\n");
+  printf("   definitely lost: %llu bytes in %zu blocks\n", current, live.size());
+  printf("\n");
+
+  /* Same format as heapusage -n reports, for use with heapusage-symbolize */
+  if (!trace.modules.empty())
+  {
+    printf("MODULE MAP:\n");
+    for (const hu_module& module : trace.modules)
+    {
+      printf("   0x%016" PRIx64 "-0x%016" PRIx64 " 0x%016" PRIx64 " %s %s\n", module.start, module.end, module.base,
+             module.build_id.empty() ? "-" : module.build_id.c_str(), module.path.c_str());
+    }
+    printf("\n");
+  }
+
+  return 0;
+}
@@ -0,0 +1,356 @@
+/*
+ * huevent.cpp
+ *
+ * Copyright (C) 2026 Kristofer Berggren
+ * All rights reserved.
+ *
+ * heapusage is distributed under the BSD 3-Clause license, see LICENSE for details.
+ *
+ */
+
+/* ----------- Includes ------------------------------------------ */
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <new>
+
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+
+#include "huevent.h"
+#include "humain.h"
+
+
+/* ----------- Defines ------------------------------------------- */
+#define HU_EVENT_RING_SIZE 4096          /* Records per thread ring, must be power of two */
+#define HU_EVENT_KEYS 64                 /* Address keyed sequence counters, must be power of two */
+#define HU_EVENT_POLL_MIN_US 1000        /* Collector poll interval while events arrive */
+#define HU_EVENT_POLL_MAX_US 100000      /* Collector poll interval when idle */
+
+
+/* ----------- Types --------------------------------------------- */
+/*
+ * hu_event_ring is a single-producer single-consumer ring owned by one
+ * application thread at a time. Rings are never unmapped; when the owning
+ * thread exits the ring is released for reuse by a later thread, and any
+ * records still in it are drained as usual.
+ */
+struct hu_event_ring
+{
+  std::atomic<uint64_t> head;   /* Consumer position */
+  std::atomic<uint64_t> tail;   /* Producer position */
+  std::atomic<bool> in_use;
+  uint64_t flush_tail;          /* Producer position at flush, protected by hu_event_drain_mutex */
+  hu_event_ring* next;
+  hu_event_t records[HU_EVENT_RING_SIZE];
+};
+
+struct hu_event_ring_owner
+{
+  hu_event_ring* ring = nullptr;
+
+  ~hu_event_ring_owner()
+  {
+    if (ring != nullptr)
+    {
+      ring->in_use.store(false, std::memory_order_release);
+    }
+  }
+};
+
+/* Sequence counter on its own cache line, so that producers only contend on equal keys */
+struct alignas(64) hu_event_counter
+{
+  std::atomic<uint64_t> next;
+};
+
+
+/* ----------- File Global Variables ----------------------------- */
+static hu_event_handler_t hu_event_handler = nullptr;
+static std::atomic<hu_event_ring*> hu_event_rings(nullptr);
+static hu_event_counter hu_event_counters[HU_EVENT_KEYS];
+static thread_local hu_event_ring_owner hu_event_owner;
+
+/* Collector wakeup, when a producer finds its ring full */
+static std::mutex* hu_event_wake_mutex = nullptr;
+static std::condition_variable* hu_event_wake = nullptr;
+
+/* Drain state, protected by hu_event_drain_mutex */
+static std::mutex* hu_event_drain_mutex = nullptr;
+static uint64_t hu_event_applied[HU_EVENT_KEYS];
+static bool hu_event_collector_running = false;
+
+
+/* ----------- Local Functions ----------------------------------- */
+/*
+ * Events are only ordered per address key, as only events on the same
+ * address, i.e. a free and a later allocation reusing it, depend on order.
+ */
+static inline size_t hu_event_key(const void* ptr)
+{
+  return (size_t)((((uint64_t)(uintptr_t)ptr >> 4) * 0x9e3779b97f4a7c15ULL) >> 32) & (HU_EVENT_KEYS - 1);
+}
+
+static hu_event_ring* hu_event_ring_acquire()
+{
+  /* Reuse a ring released by an exited thread */
+  for (hu_event_ring* ring = hu_event_rings.load(std::memory_order_acquire); ring != nullptr;
+       ring = ring->next)
+  {
+    bool expected = false;
+    if (!ring->in_use.load(std::memory_order_relaxed) &&
+        ring->in_use.compare_exchange_strong(expected, true, std::memory_order_acquire))
+    {
+      return ring;
+    }
+  }
+
+  /* Otherwise map a new one, outside of the interposed allocator */
+  void* mem = mmap(nullptr, sizeof(hu_event_ring), PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (mem == MAP_FAILED) return nullptr;
+
+  hu_event_ring* ring = new (mem) hu_event_ring();
+  ring->head.store(0, std::memory_order_relaxed);
+  ring->tail.store(0, std::memory_order_relaxed);
+  ring->in_use.store(true, std::memory_order_relaxed);
+  ring->flush_tail = 0;
+  ring->next = hu_event_rings.load(std::memory_order_relaxed);
+  while (!hu_event_rings.compare_exchange_weak(ring->next, ring, std::memory_order_release,
+                                               std::memory_order_relaxed))
+  {
+  }
+
+  return ring;
+}
+
+/*
+ * hu_event_drain applies published records in place, each ring in order,
+ * and a record only once all earlier events on its address key have been
+ * applied. Such an earlier record may not be published yet (its producer is
+ * between taking a sequence number and publishing), in which case the ring
+ * waits for a later drain. Records cannot wait on each other in a cycle, as
+ * sequence numbers are taken in the order events happen. With force, as
+ * after fork when no other producer remains, records are applied in ring
+ * order regardless. Caller must hold hu_event_drain_mutex. Returns number of
+ * records applied.
+ */
+static size_t hu_event_drain(bool force)
+{
+  size_t applied = 0;
+  bool progress = true;
+  while (progress)
+  {
+    progress = false;
+    for (hu_event_ring* ring = hu_event_rings.load(std::memory_order_acquire); ring != nullptr;
+         ring = ring->next)
+    {
+      uint64_t head = ring->head.load(std::memory_order_relaxed);
+      const uint64_t tail = ring->tail.load(std::memory_order_acquire);
+      while (head != tail)
+      {
+        const hu_event_t* record = &ring->records[head & (HU_EVENT_RING_SIZE - 1)];
+        uint64_t& key_applied = hu_event_applied[hu_event_key(record->ptr)];
+        if (!force && (record->seq != key_applied)) break;
+
+        hu_event_handler(record);
+        key_applied = std::max(key_applied, record->seq + 1);
+        ring->head.store(++head, std::memory_order_release);
+        ++applied;
+        progress = true;
+      }
+    }
+  }
+
+  return applied;
+}
+
+/* Apply an event synchronously, after earlier events on its address */
+static void hu_event_apply(hu_event_t* record)
+{
+  std::lock_guard<std::mutex> lock(*hu_event_drain_mutex);
+  const size_t key = hu_event_key(record->ptr);
+  record->seq = hu_event_counters[key].next.fetch_add(1, std::memory_order_acq_rel);
+  if (hu_event_collector_running)
+  {
+    while (hu_event_applied[key] != record->seq)
+    {
+      if (hu_event_drain(false) == 0)
+      {
+        sched_yield();
+      }
+    }
+  }
+  else
+  {
+    hu_event_drain(true);
+  }
+
+  hu_event_handler(record);
+  hu_event_applied[key] = std::max(hu_event_applied[key], record->seq + 1);
+}
+
+static void* hu_event_collector(void*)
+{
+  /* Collector allocations (tracking tables) are not tracked */
+  hu_set_bypass(true);
+
+  /* Poll less often while idle, producers with a full ring wake the collector */
+  unsigned interval_us = HU_EVENT_POLL_MIN_US;
+  while (true)
+  {
+    size_t applied = 0;
+    {
+      std::lock_guard<std::mutex> lock(*hu_event_drain_mutex);
+      applied = hu_event_drain(false);
+    }
+
+    if (applied > 0)
+    {
+      interval_us = HU_EVENT_POLL_MIN_US;
+      continue;
+    }
+
+    std::unique_lock<std::mutex> lock(*hu_event_wake_mutex);
+    hu_event_wake->wait_for(lock, std::chrono::microseconds(interval_us));
+    interval_us = std::min(interval_us * 2, (unsigned)HU_EVENT_POLL_MAX_US);
+  }
+
+  return nullptr;
+}
+
+/*
+ * A forked child has no collector thread, so its events are applied
+ * synchronously. The drain lock is recreated, as the collector may have
+ * held it at fork.
+ */
+static void hu_event_atfork_child()
+{
+  if (!hu_event_collector_running) return;
+
+  new (hu_event_drain_mutex) std::mutex();
+  new (hu_event_wake_mutex) std::mutex();
+  hu_event_collector_running = false;
+}
+
+
+/* ----------- Global Functions ---------------------------------- */
+bool hu_event_init(hu_event_handler_t handler)
+{
+  hu_event_drain_mutex = new std::mutex();
+  hu_event_wake_mutex = new std::mutex();
+  hu_event_wake = new std::condition_variable();
+  hu_event_handler = handler;
+
+  /* Start collector with all signals blocked, so none is delivered to it */
+  sigset_t all_signals;
+  sigset_t old_signals;
+  sigfillset(&all_signals);
+  pthread_sigmask(SIG_SETMASK, &all_signals, &old_signals);
+  pthread_t thread;
+  int rv = pthread_create(&thread, nullptr, hu_event_collector, nullptr);
+  pthread_sigmask(SIG_SETMASK, &old_signals, nullptr);
+  if (rv != 0)
+  {
+    fprintf(stderr, "heapusage error: unable to start collector thread, errno %d\n", rv);
+    hu_event_handler = nullptr;
+    return false;
+  }
+
+  pthread_detach(thread);
+  hu_event_collector_running = true;
+  pthread_atfork(nullptr, nullptr, hu_event_atfork_child);
+  return true;
+}
+
+void hu_event_push(int event, void* ptr, size_t size, uint32_t callstack_id)
+{
+  hu_event_ring* ring = hu_event_owner.ring;
+  if ((ring == nullptr) || !hu_event_collector_running)
+  {
+    if (hu_event_collector_running)
+    {
+      ring = hu_event_owner.ring = hu_event_ring_acquire();
+    }
+
+    if (ring == nullptr)
+    {
+      /* Unable to map a ring, or no collector after fork */
+      hu_event_t record;
+      record.event = event;
+      record.ptr = ptr;
+      record.size = size;
+      record.callstack_id = callstack_id;
+      hu_event_apply(&record);
+      return;
+    }
+  }
+
+  /* Wait for collector if ring is full */
+  const uint64_t tail = ring->tail.load(std::memory_order_relaxed);
+  if ((tail - ring->head.load(std::memory_order_acquire)) >= HU_EVENT_RING_SIZE)
+  {
+    hu_event_wake->notify_one();
+    while ((tail - ring->head.load(std::memory_order_acquire)) >= HU_EVENT_RING_SIZE)
+    {
+      sched_yield();
+    }
+  }
+
+  hu_event_t* record = &ring->records[tail & (HU_EVENT_RING_SIZE - 1)];
+  record->event = event;
+  record->ptr = ptr;
+  record->size = size;
+  record->callstack_id = callstack_id;
+
+  /* Sequence number is taken last, to keep the unpublished window short */
+  record->seq = hu_event_counters[hu_event_key(ptr)].next.fetch_add(1, std::memory_order_acq_rel);
+  ring->tail.store(tail + 1, std::memory_order_release);
+}
+
+/*
+ * hu_event_flush is a barrier ensuring that all events pushed before the
+ * call have been applied.
+ */
+void hu_event_flush()
+{
+  if (hu_event_handler == nullptr) return;
+
+  std::lock_guard<std::mutex> lock(*hu_event_drain_mutex);
+  if (!hu_event_collector_running)
+  {
+    hu_event_drain(true);
+    return;
+  }
+
+  for (hu_event_ring* ring = hu_event_rings.load(std::memory_order_acquire); ring != nullptr;
+       ring = ring->next)
+  {
+    ring->flush_tail = ring->tail.load(std::memory_order_acquire);
+  }
+
+  while (true)
+  {
+    bool flushed = true;
+    for (hu_event_ring* ring = hu_event_rings.load(std::memory_order_acquire); ring != nullptr;
+         ring = ring->next)
+    {
+      flushed = flushed && (ring->head.load(std::memory_order_relaxed) >= ring->flush_tail);
+    }
+
+    if (flushed) break;
+
+    if (hu_event_drain(false) == 0)
+    {
+      sched_yield();
+    }
+  }
+}
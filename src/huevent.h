@@ -0,0 +1,37 @@
+/*
+ * huevent.h
+ *
+ * Copyright (C) 2026 Kristofer Berggren
+ * All rights reserved.
+ *
+ * heapusage is distributed under the BSD 3-Clause license, see LICENSE for details.
+ *
+ */
+
+#pragma once
+
+/* ----------- Includes ------------------------------------------ */
+#include <cstddef>
+#include <cstdint>
+
+#include "hulog.h"
+
+
+/* ----------- Types --------------------------------------------- */
+typedef struct hu_event_s
+{
+  uint64_t seq;
+  int event;
+  uint32_t callstack_id;
+  void* ptr;
+  size_t size;
+}
+hu_event_t;
+
+typedef void (*hu_event_handler_t)(const hu_event_t* event);
+
+
+/* ----------- Global Function Prototypes ------------------------ */
+bool hu_event_init(hu_event_handler_t handler);
+void hu_event_push(int event, void* ptr, size_t size, uint32_t callstack_id);
+void hu_event_flush();
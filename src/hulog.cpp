@@ -15,20 +15,37 @@
 
 #include <cxxabi.h>
 #include <dlfcn.h>
+#include <errno.h>
 #include <execinfo.h>
 #include <inttypes.h>
 #include <libgen.h>
+#include <limits.h>
+#if !defined(__APPLE__)
+#include <link.h>
+#endif
+#include <math.h>
 #include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
+#include <sys/mman.h>
+#if defined(__linux__)
+#include <sys/syscall.h>
+#endif
+#include <sys/wait.h>
+
+#include <algorithm>
+#include <atomic>
 #include <map>
+#include <mutex>
 #include <set>
 #include <string>
 #include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
 #if defined(__APPLE__)
@@ -37,16 +54,16 @@
 #endif
 #include "backward.hpp"
 
+#include "huevent.h"
 #include "hulog.h"
 #include "humain.h"
 #include "humalloc.h"
-
-
-/* ----------- Defines ------------------------------------------- */
-/* Can be externally overridden. */
-#if !defined(MAX_CALL_STACK)
-#define MAX_CALL_STACK 20   /* Limits the callstack depth to store */
-#endif
+#include "hustack.h"
+#include "hutable.h"
+#include "hutimeline.h"
+#include "hutrace.h"
+#include "huunwind.h"
+#include "huwriter.h"
 
 
 /* ----------- Types --------------------------------------------- */
@@ -54,566 +71,2072 @@ typedef struct hu_allocinfo_s
 {
   void* ptr;
   size_t size;
-  void* callstack[MAX_CALL_STACK];
-  int callstack_depth;
-  void* free_callstack[MAX_CALL_STACK];
-  int free_callstack_depth;
-  int count;
+  uint32_t callstack_id;
+  uint32_t free_callstack_id;
+  int kind;   /* Allocating function, log_alloc_kind */
 }
 hu_allocinfo_t;
 
+/* Allocation site, with lost blocks grouped by call stack */
+typedef struct hu_siteinfo_s
+{
+  size_t size;
+  unsigned long long count;
+  uint32_t callstack_id;
+}
+hu_siteinfo_t;
+
+/* Free'd block, with sequence number of the free recorded in free history */
+typedef struct hu_freedinfo_s
+{
+  hu_allocinfo_t allocinfo;
+  uint64_t seq;
+}
+hu_freedinfo_t;
+
+typedef struct hu_history_entry_s
+{
+  void* ptr;
+  uint64_t seq;
+}
+hu_history_entry_t;
+
+/*
+ * Allocation tracking is partitioned into shards keyed by pointer hash, each
+ * with its own lock, so that threads operating on unrelated blocks do not
+ * contend. A thread never holds more than one shard lock at a time, except
+ * log_summary() which acquires all of them in index order.
+ *
+ * With double-free detection, free'd blocks are kept in a bounded free
+ * history: a ring of the most recent frees, oldest first, indexed by address
+ * through freed_allocations. Ring entries whose block has since been removed
+ * from the index (address reused, or evicted from quarantine) are stale, and
+ * are skipped when aged out, as their sequence number no longer matches.
+ */
+struct hu_log_shard
+{
+  std::mutex mutex;
+  hu_table<hu_allocinfo_t> allocations;
+  hu_table<hu_freedinfo_t> freed_allocations;
+  hu_history_entry_t* history = nullptr;
+  size_t history_head = 0;
+  size_t history_count = 0;
+  uint64_t history_seq = 0;
+  unsigned long long history_bytes = 0;
+  unsigned long long history_aged_out = 0;
+};
+
+
+/* ----------- Defines ------------------------------------------- */
+#if (BACKWARD_HAS_BFD == 1) || (BACKWARD_HAS_DW == 1) || (BACKWARD_HAS_DWARF == 1)
+#define LOG_HAS_RESOLVER 1   /* Symbols resolved from debug info, rather than dladdr() */
+#else
+#define LOG_HAS_RESOLVER 0
+#endif
+
+#define LOG_SAMPLE_FILTER_SIZE (1 << 18)   /* Sampled block filter counters, must be power of two */
+#define LOG_SAMPLE_COUNT_SHIFT 16          /* Fraction bits of sampled block count estimates */
+#define LOG_TIMELINE_CLOCK_STEP 64         /* Allocations per thread between timeline clock reads */
+#define LOG_PEAK_HYSTERESIS_SHIFT 6        /* Peak growth, as fraction 1 / 2^n, before new capture */
+#define LOG_PEAK_SITES 10                  /* Sites output in peak summary */
+#define LOG_FAULT_LOCK_POLL_NS 1000000     /* Fault handler poll interval for a held lock */
+#define LOG_FAULT_LOCK_POLLS 100           /* Polls before fault handler does without lock */
+
+#if defined(__linux__)
+#define LOG_REPORT_WAIT_FLAGS __WALL   /* Report child exits without SIGCHLD */
+#else
+#define LOG_REPORT_WAIT_FLAGS 0
+#endif
+
+
+/* ----------- Global Variables ---------------------------------- */
+static void log_ignore_event(int event, void* ptr, size_t size);
+log_event_handler_t log_event_handler = log_ignore_event;
+
 
 /* ----------- File Global Variables ----------------------------- */
 static pid_t pid = 0;
-static char* hu_log_file = nullptr;
+static const char* hu_log_file = nullptr;
 static int hu_log_free = 0;
 static int hu_log_nosyms = 0;
 static size_t hu_log_minleak = 0;
+static size_t hu_log_history_capacity = 0;   /* Free history entries per shard */
+static size_t hu_log_history_max_bytes = 0;  /* Free history bytes per shard, zero if unlimited */
 static bool hu_useafterfree = false;
 static bool hu_leak = false;
 static bool hu_log_repeat = false;
+static bool hu_log_async = false;
+static const char* hu_log_trace_file = nullptr;
+static bool hu_log_trace_only = false;
 static char hu_prefix[32] = "";
 
-static long hu_page_size = 0;
-static int logging_enabled = 0;
 
-static unsigned long long allocinfo_total_frees = 0;
-static unsigned long long allocinfo_total_allocs = 0;
-static unsigned long long allocinfo_total_alloc_bytes = 0;
-static unsigned long long allocinfo_current_alloc_bytes = 0;
-static unsigned long long allocinfo_peak_alloc_bytes = 0;
+static std::atomic<unsigned long long> allocinfo_total_frees(0);
+static std::atomic<unsigned long long> allocinfo_total_allocs(0);
+static std::atomic<unsigned long long> allocinfo_total_alloc_bytes(0);
+static std::atomic<unsigned long long> allocinfo_current_alloc_bytes(0);
+static std::atomic<unsigned long long> allocinfo_current_alloc_blocks(0);
+static std::atomic<unsigned long long> allocinfo_peak_alloc_bytes(0);
+
+/*
+ * Sampling state. Each thread samples allocations at byte intervals drawn
+ * from an exponential distribution with mean hu_log_sample_rate, so a block
+ * of size s is sampled with probability 1 - exp(-s / rate) independently of
+ * earlier allocations. Only sampled blocks are tracked. Frees are filtered
+ * through per-bucket counts of live sampled blocks, so that most of them do
+ * not need to look up the tracking tables.
+ */
+static size_t hu_log_sample_rate = 0;
+static std::atomic<uint32_t>* log_sample_filter = nullptr;
+static thread_local uint64_t log_sample_rng = 0;
+static thread_local int64_t log_sample_countdown = 0;
+
+/*
+ * Timeline state. A snapshot is taken by the thread applying an allocation
+ * once hu_log_timeline_bytes more bytes have been allocated, or
+ * hu_log_timeline_ms milliseconds have passed, since the previous one. The
+ * clock is only read every LOG_TIMELINE_CLOCK_STEP allocations per thread.
+ */
+static bool hu_log_timeline = false;
+static const char* hu_log_command = nullptr;
+static const char* hu_log_timeline_file = nullptr;
+static size_t hu_log_timeline_bytes = 0;
+static size_t hu_log_timeline_ms = 0;
+static size_t hu_log_timeline_top = 0;
+static std::mutex* log_timeline_mutex = nullptr;
+static std::atomic<unsigned long long> log_timeline_next_bytes(0);
+static std::atomic<unsigned long long> log_timeline_next_ms(0);
+static thread_local int log_timeline_countdown = 0;
+
+/*
+ * Site state. With leak analysis or timeline, bytes and blocks in use are
+ * counted per allocation site in the stack depot as blocks are allocated and
+ * free'd, so that reports and snapshots cost O(sites) rather than O(blocks).
+ * With the peak tool, when heap usage exceeds the last captured peak by a
+ * margin, the counters of all sites in use are copied to log_peak_sites. The
+ * margin bounds the number of captures when usage oscillates near its peak.
+ */
+static bool hu_log_sites = false;
+static bool hu_log_peak = false;       /* Capture and report sites at peak */
+static size_t hu_log_leak_sites = 0;   /* Leak sites output, zero if unlimited */
+static std::mutex* log_peak_mutex = nullptr;
+static std::vector<hu_siteinfo_t>* log_peak_sites = nullptr;
+static std::atomic<unsigned long long> log_peak_threshold(0);
+static unsigned long long log_peak_bytes = 0;
+static unsigned long long log_peak_blocks = 0;
 
-static std::unordered_map<void*, hu_allocinfo_t>* allocations = nullptr;
-static std::unordered_map<void*, hu_allocinfo_t>* freed_allocations = nullptr;
-static std::map<void*, std::string>* symbol_cache = nullptr;
+/*
+ * Forked report state. On-demand reports may be written by a child process
+ * forked while all shard locks are held, from its copy-on-write view of the
+ * tracking state, so that the process is only paused for the fork itself.
+ * Symbols are resolved before forking, as the child must not take locks
+ * other threads may have held. Any output to the log file waits for the
+ * child to finish first, so that its report is not interleaved.
+ */
+static bool hu_log_report_fork = false;
+static bool log_in_report_child = false;
+static pid_t log_report_child = 0;
+
+static hu_log_shard* log_shards = nullptr;
+static size_t log_shard_mask = 0;
+
+/* Mutex protecting error reporting state, symbol caches and log file output */
+static std::mutex* log_report_mutex = nullptr;
+static std::unordered_map<void*, std::string>* symbol_cache = nullptr;
+#if LOG_HAS_RESOLVER
+static backward::TraceResolver* trace_resolver = nullptr;
+static std::unordered_map<uint64_t, std::string>* module_symbol_cache = nullptr;
+static std::map<std::string, uint64_t>* module_ids = nullptr;
+#endif
 static std::map<void*, std::string>* objfile_cache = nullptr;
-static std::set<std::vector<void*>>* reported_invalid_dealloc_callstacks = nullptr;
-static std::set<std::vector<void*>>* reported_invalid_access_callstacks = nullptr;
+static std::set<uint32_t>* reported_invalid_dealloc_callstacks = nullptr;
+static std::set<uint32_t>* reported_invalid_access_callstacks = nullptr;
+static std::set<uint32_t>* reported_mismatched_dealloc_callstacks = nullptr;
 static unsigned long long total_invalid_dealloc_count = 0;
 static unsigned long long total_invalid_access_count = 0;
+static unsigned long long total_mismatched_dealloc_count = 0;
 
 
 /* ----------- Local Functions ----------------------------------- */
-struct size_compare
+/* Allocation function family, which must match the deallocation function */
+enum log_alloc_kind
 {
-  bool operator()(const hu_allocinfo_t& lhs, const hu_allocinfo_t& rhs) const
-  {
-    return lhs.size < rhs.size;
-  }
+  LOG_ALLOC_MALLOC,      /* malloc(), calloc(), realloc() and free() */
+  LOG_ALLOC_NEW,         /* operator new and delete */
+  LOG_ALLOC_NEW_ARRAY,   /* operator new[] and delete[] */
 };
 
-static std::string addr_to_symbol(void* addr);
-
-
-/* ----------- Global Functions ---------------------------------- */
-void log_init(char* file, bool doublefree, bool nosyms, size_t minsize, bool useafterfree,
-              bool leak, const char* command, bool log_pid_prefix, bool log_repeat)
+/*
+ * Event handlers are instantiated per tool configuration, so that each does
+ * only the work needed by its configuration, see log_select_handler().
+ */
+enum log_mode
 {
-  /* Config */
-  hu_log_file = file;
-  hu_log_free = doublefree;
-  hu_log_nosyms = nosyms;
-  hu_log_minleak = minsize;
-  hu_useafterfree = useafterfree;
-  hu_leak = leak;
-  hu_log_repeat = log_repeat;
-
-  /* Get runtime info */
-  pid = getpid();
-  hu_page_size = sysconf(_SC_PAGE_SIZE);
-
-  /* Set up log line prefix */
-  if (log_pid_prefix)
-  {
-    snprintf(hu_prefix, sizeof(hu_prefix), "==%d== ", pid);
-  }
+  LOG_MODE_COUNT,        /* Only count totals, when tracing only */
+  LOG_MODE_LEAK,         /* Track allocations */
+  LOG_MODE_LEAK_ASYNC,   /* Track allocations, applied on collector thread */
+  LOG_MODE_SAMPLE,       /* Track sampled allocations */
+  LOG_MODE_ERROR,        /* Track allocations and free'd blocks */
+};
 
-  /* Initial log output */
-  if (hu_log_file != nullptr)
-  {
-    FILE* f = fopen(hu_log_file, "w");
-    if (f != nullptr)
-    {
-      const char* hu_version = getenv("HU_VERSION");
-      if ((hu_version != nullptr) && hu_version[0])
-      {
-        fprintf(f, "%sHeapusage v%s - https://github.com/d99kris/heapusage\n", hu_prefix, hu_version);
-      }
-      else
-      {
-        fprintf(f, "%sHeapusage - https://github.com/d99kris/heapusage\n", hu_prefix);
-      }
-      fprintf(f, "%sCommand: %s\n", hu_prefix, (command != nullptr) ? command : "");
-      fprintf(f, "%sProcess: %d\n", hu_prefix, pid);
-      fprintf(f, "%s\n", hu_prefix);
-      fclose(f);
-    }
-    else
-    {
-      fprintf(stderr, "heapusage error: unable to open output file (%s) for writing\n", hu_log_file);
-    }
-  }
-  else
-  {
-    fprintf(stderr, "heapusage error: no output file specified\n");
-  }
+struct log_report_state;
 
-  allocations = new std::unordered_map<void*, hu_allocinfo_t>();
-  freed_allocations = new std::unordered_map<void*, hu_allocinfo_t>();
-  symbol_cache = new std::map<void*, std::string>();
-  objfile_cache = new std::map<void*, std::string>();
-  reported_invalid_dealloc_callstacks = new std::set<std::vector<void*>>();
-  reported_invalid_access_callstacks = new std::set<std::vector<void*>>();
+static std::string addr_to_symbol(void* addr);
+static void log_resolve_symbols(const std::vector<void*>& addrs);
+template <bool TRACK_FREED>
+static void log_malloc(void* ptr, size_t size, uint32_t callstack_id, int kind);
+template <bool TRACK_FREED>
+static inline __attribute__((always_inline)) void log_free(void* ptr, uint32_t callstack_id, int kind,
+                                                           size_t size);
+static void log_apply_event(const hu_event_t* event);
+static void log_mismatched_dealloc(void* ptr, uint32_t callstack_id, int kind, size_t size,
+                                   const hu_allocinfo_t& allocinfo);
+static log_event_handler_t log_select_handler();
+static void log_timeline_snapshot(bool force);
+static void log_get_leak_sites(std::vector<hu_siteinfo_t>& sites);
+static void log_prepare_sites(const std::vector<hu_siteinfo_t>& leak_sites,
+                              const std::vector<hu_siteinfo_t>& peak_sites);
+static pid_t log_report_spawn();
+static void log_write_summary(bool ondemand, const log_report_state& state);
+static void log_report_wait();
+static void log_peak_capture(unsigned long long current);
+
+static inline hu_log_shard& log_shard(void* ptr)
+{
+  return log_shards[hu_shard_index(ptr, log_shard_mask)];
 }
 
-void log_enable(int flag)
+static inline bool log_is_free_event(int event)
 {
-  logging_enabled = flag;
+  return (event == EVENT_FREE) || (event == EVENT_DELETE) || (event == EVENT_DELETE_ARRAY);
 }
 
-void log_print_callstack(FILE* f, int callstack_depth, void* const callstack[])
+static inline int log_event_kind(int event)
 {
-  if (callstack_depth > 0)
+  switch (event)
   {
-    int i = 1;
-    while (i < callstack_depth)
-    {
-#if UINTPTR_MAX == 0xffffffff
-      fprintf(f, "%s   at 0x%08x", hu_prefix, (unsigned int)callstack[i]);
-#else
-      fprintf(f, "%s   at 0x%016" PRIxPTR, hu_prefix, (unsigned long)callstack[i]);
-#endif
+    case EVENT_NEW:
+    case EVENT_DELETE:
+      return LOG_ALLOC_NEW;
 
-      if (hu_log_nosyms)
-      {
-        fprintf(f, "\n");
-      }
-      else
-      {
-        std::string symbol = addr_to_symbol(callstack[i]);
-        fprintf(f, ": %s\n", symbol.empty() ? "???" : symbol.c_str());
-      }
+    case EVENT_NEW_ARRAY:
+    case EVENT_DELETE_ARRAY:
+      return LOG_ALLOC_NEW_ARRAY;
 
-      ++i;
-    }
-  }
-  else
-  {
-    fprintf(f, "%s   error: backtrace() returned empty callstack\n", hu_prefix);
+    default:
+      return LOG_ALLOC_MALLOC;
   }
 }
 
-bool log_is_valid_callstack(int callstack_depth, void* const callstack[], bool is_alloc)
+/*
+ * Intern call stack of the event handler. Always inlined, also into callers
+ * inlined into the handler, so that the stack starts in the handler frame.
+ */
+static inline __attribute__((always_inline)) uint32_t log_capture_stack()
 {
-  int i = callstack_depth - 1;
-  std::string objfile;
-  while (i > 0)
-  {
-    void* addr = callstack[i];
-
-    auto it = objfile_cache->find(addr);
-    if (it != objfile_cache->end())
-    {
-      objfile = it->second;
-    }
-    else
-    {
-      Dl_info dlinfo;
-      if (dladdr(addr, &dlinfo) && (dlinfo.dli_fname != nullptr))
-      {
-        char* fname = strdup(dlinfo.dli_fname);
-        if (fname != nullptr)
-        {
-          objfile = std::string(basename(fname));
-          (*objfile_cache)[addr] = objfile;
-          free(fname);
-        }
-      }
-    }
+  void* callstack[MAX_CALL_STACK];
+  const int callstack_depth = hu_unwind(callstack, MAX_CALL_STACK);
+  return hu_stack_intern(callstack, callstack_depth);
+}
 
-    if (!objfile.empty())
-    {
-      // For now only care about originating object file
-      break;
-    }
+/* Remove free'd block, optionally returning it. Caller must hold shard lock. */
+static inline bool log_freed_erase(hu_log_shard& shard, void* ptr, hu_allocinfo_t* allocinfo)
+{
+  hu_freedinfo_t freedinfo;
+  if (!shard.freed_allocations.erase(ptr, &freedinfo)) return false;
 
-    --i;
+  if (shard.history != nullptr)
+  {
+    shard.history_bytes -= freedinfo.allocinfo.size;
   }
 
-  if (!objfile.empty())
+  if (allocinfo != nullptr)
   {
-    // ignore invalid dealloc from libobjc
-    if (!is_alloc && (objfile == "libobjc.A.dylib")) return false;
+    *allocinfo = freedinfo.allocinfo;
   }
 
   return true;
 }
 
-void log_event(int event, void* ptr, size_t size)
+/* Age out oldest free in history. Caller must hold shard lock. */
+static void log_history_pop(hu_log_shard& shard)
 {
-  if (logging_enabled)
+  const hu_history_entry_t entry = shard.history[shard.history_head];
+  shard.history_head = (shard.history_head + 1) % hu_log_history_capacity;
+  --shard.history_count;
+
+  const hu_freedinfo_t* freedinfo = shard.freed_allocations.find(entry.ptr);
+  if ((freedinfo != nullptr) && (freedinfo->seq == entry.seq))
   {
-    if (event == EVENT_MALLOC)
-    {
-      if (hu_useafterfree || hu_log_free)
-      {
-        freed_allocations->erase(ptr);
-      }
+    log_freed_erase(shard, entry.ptr, nullptr);
+    ++shard.history_aged_out;
+  }
+}
 
-      if (size >= hu_log_minleak)
-      {
-        hu_allocinfo_t allocinfo;
-        allocinfo.size = size;
-        allocinfo.ptr = ptr;
-        allocinfo.callstack_depth = backtrace(allocinfo.callstack, MAX_CALL_STACK);
-        allocinfo.count = 1;
-        (*allocations)[ptr] = allocinfo;
-
-        allocinfo_total_allocs += 1;
-        allocinfo_total_alloc_bytes += size;
-        allocinfo_current_alloc_bytes += size;
-
-        if (allocinfo_current_alloc_bytes > allocinfo_peak_alloc_bytes)
-        {
-          allocinfo_peak_alloc_bytes = allocinfo_current_alloc_bytes;
-        }
-      }
-    }
-    else if (event == EVENT_FREE)
-    {
-      auto allocation = allocations->find(ptr);
-      if (allocation != allocations->end())
-      {
-        allocinfo_current_alloc_bytes -= allocation->second.size;
+/* Add free'd block, aging out the oldest frees if history is full. Caller must hold shard lock. */
+static void log_freed_insert(hu_log_shard& shard, void* ptr, const hu_allocinfo_t& allocinfo)
+{
+  hu_freedinfo_t freedinfo;
+  freedinfo.allocinfo = allocinfo;
+  freedinfo.seq = 0;
+  if (shard.history == nullptr)
+  {
+    shard.freed_allocations.insert(ptr, freedinfo);
+    return;
+  }
 
-        if (hu_useafterfree || hu_log_free)
-        {
-          allocation->second.free_callstack_depth =
-            backtrace(allocation->second.free_callstack, MAX_CALL_STACK);
-          freed_allocations->insert(*allocation);
-        }
+  while ((shard.history_count > 0) &&
+         ((shard.history_count == hu_log_history_capacity) ||
+          ((hu_log_history_max_bytes != 0) &&
+           ((shard.history_bytes + allocinfo.size) > hu_log_history_max_bytes))))
+  {
+    log_history_pop(shard);
+  }
 
-        allocations->erase(ptr);
-      }
-      else if (hu_log_free)
-      {
-        allocation = freed_allocations->find(ptr);
-        if (allocation != freed_allocations->end())
-        {
-          void* callstack[MAX_CALL_STACK];
-          int callstack_depth = backtrace(callstack, MAX_CALL_STACK);
-          if (log_is_valid_callstack(callstack_depth, callstack, false))
-          {
-            total_invalid_dealloc_count++;
-            std::vector<void*> cs_key(callstack + 1, callstack + callstack_depth);
-            bool is_new = reported_invalid_dealloc_callstacks->insert(cs_key).second;
-            if (is_new || hu_log_repeat)
-            {
-              FILE* f = fopen(hu_log_file, "a");
-              if (f != nullptr)
-              {
-                fprintf(f, "%sInvalid deallocation at:\n", hu_prefix);
+  freedinfo.seq = ++shard.history_seq;
+  if (!shard.freed_allocations.insert(ptr, freedinfo)) return;
 
-                log_print_callstack(f, callstack_depth, callstack);
+  hu_history_entry_t& entry =
+    shard.history[(shard.history_head + shard.history_count) % hu_log_history_capacity];
+  entry.ptr = ptr;
+  entry.seq = freedinfo.seq;
+  ++shard.history_count;
+  shard.history_bytes += allocinfo.size;
+}
 
-                fprintf(f, "%s Address %p is a block of size %ld free'd at:\n",
-                        hu_prefix, ptr, allocation->second.size);
+static inline int64_t log_sample_interval()
+{
+  /* xorshift64* */
+  log_sample_rng ^= log_sample_rng >> 12;
+  log_sample_rng ^= log_sample_rng << 25;
+  log_sample_rng ^= log_sample_rng >> 27;
+  const uint64_t rnd = log_sample_rng * 0x2545f4914f6cdd1dULL;
+
+  /* Uniform in (0, 1] mapped to exponential distribution */
+  const double uniform = (double)((rnd >> 11) + 1) / 9007199254740992.0;
+  return (int64_t)(-log(uniform) * (double)hu_log_sample_rate) + 1;
+}
 
-                log_print_callstack(f, allocation->second.free_callstack_depth,
-                                    allocation->second.free_callstack);
+static inline bool log_sample(size_t size)
+{
+  if (log_sample_rng == 0)
+  {
+    /* Seed from per-thread address and time, never zero */
+    log_sample_rng = ((uint64_t)(uintptr_t)&log_sample_rng ^ (uint64_t)time(nullptr)) | 1;
+    log_sample_countdown = log_sample_interval();
+  }
 
-                fprintf(f, "%s Block was alloc'd at:\n", hu_prefix);
+  log_sample_countdown -= (int64_t)size;
+  if (log_sample_countdown > 0) return false;
 
-                log_print_callstack(f, allocation->second.callstack_depth,
-                                    allocation->second.callstack);
+  log_sample_countdown = log_sample_interval();
+  return true;
+}
 
-                fprintf(f, "%s\n", hu_prefix);
+static inline std::atomic<uint32_t>& log_sample_filter_count(void* ptr)
+{
+  return log_sample_filter[hu_shard_index(ptr, LOG_SAMPLE_FILTER_SIZE - 1)];
+}
 
-                fclose(f);
-              }
-            }
-          }
+/*
+ * log_scaled_size returns the unbiased estimate of bytes allocated that a
+ * tracked block represents, i.e. its size divided by its sampling probability.
+ */
+static inline unsigned long long log_scaled_size(size_t size)
+{
+  if (hu_log_sample_rate == 0) return size;
 
-          freed_allocations->erase(allocation);
-        }
-      }
+  return llround((double)size / -expm1(-(double)size / (double)hu_log_sample_rate));
+}
 
-      allocinfo_total_frees += 1;
-    }
+/*
+ * Block count estimates 1 / p are kept with LOG_SAMPLE_COUNT_SHIFT fraction
+ * bits, as rounding each to a whole number of blocks would bias their sum.
+ */
+static inline unsigned long long log_scaled_count(size_t size)
+{
+  if (hu_log_sample_rate == 0) return 1;
 
-  }
+  return llround(ldexp(1.0 / -expm1(-(double)size / (double)hu_log_sample_rate), LOG_SAMPLE_COUNT_SHIFT));
 }
 
-void hu_sig_handler(int sig, siginfo_t* si, void* /*ucontext*/)
+/* Number of blocks from a sum of log_scaled_count() */
+static inline unsigned long long log_block_count(unsigned long long count)
 {
-  if ((sig != SIGSEGV) && (sig != SIGBUS)) return;
+  if (hu_log_sample_rate == 0) return count;
 
-  hu_set_bypass(true);
+  return (count + (1ULL << (LOG_SAMPLE_COUNT_SHIFT - 1))) >> LOG_SAMPLE_COUNT_SHIFT;
+}
 
-  void* ptr = si->si_addr;
-  void* callstack[MAX_CALL_STACK];
-  int callstack_depth = backtrace(callstack, MAX_CALL_STACK);
-  if (log_is_valid_callstack(callstack_depth, callstack, false))
+static inline void log_update_peak(unsigned long long current)
+{
+  unsigned long long peak = allocinfo_peak_alloc_bytes.load(std::memory_order_relaxed);
+  while ((current > peak) &&
+         !allocinfo_peak_alloc_bytes.compare_exchange_weak(peak, current, std::memory_order_relaxed))
   {
-    total_invalid_access_count++;
-    std::vector<void*> cs_key(callstack + 1, callstack + callstack_depth);
-    bool is_new = reported_invalid_access_callstacks->insert(cs_key).second;
-    if (is_new || hu_log_repeat)
-    {
-      FILE* f = fopen(hu_log_file, "a");
-      if (f != nullptr)
-      {
-        fprintf(f, "%sInvalid memory access at:\n", hu_prefix);
+  }
+}
 
-        log_print_callstack(f, callstack_depth, callstack);
+/* Get allocation sites with blocks in use, from their live counters */
+static void log_get_sites(std::vector<hu_siteinfo_t>& sites)
+{
+  sites.clear();
+  const uint32_t count = hu_stack_count();
+  for (uint32_t id = HU_STACK_ID_NONE + 1; id < count; ++id)
+  {
+    unsigned long long bytes = 0;
+    unsigned long long blocks = 0;
+    if (!hu_stack_get_live(id, &bytes, &blocks)) continue;
+
+    hu_siteinfo_t site;
+    site.callstack_id = id;
+    site.size = bytes;
+    site.count = log_block_count(blocks);
+    sites.push_back(site);
+  }
+}
 
-        bool found = false;
+/* Keep the limit sites with the most bytes in use (all if zero), largest first */
+static void log_top_sites(std::vector<hu_siteinfo_t>& sites, size_t limit)
+{
+  auto larger = [](const hu_siteinfo_t& lhs, const hu_siteinfo_t& rhs)
+  {
+    return (lhs.size != rhs.size) ? (lhs.size > rhs.size) : (lhs.callstack_id < rhs.callstack_id);
+  };
 
-        /* Search active allocations for the block containing the faulting address */
-        for (auto allocation = allocations->begin(); allocation != allocations->end(); ++allocation)
-        {
-          if ((ptr >= ((char*)allocation->second.ptr + allocation->second.size)) &&
-              (ptr <= ((char*)allocation->second.ptr + allocation->second.size + hu_page_size)))
-          {
-            found = true;
-            size_t offset = (char*)ptr - ((char*)allocation->second.ptr + allocation->second.size);
+  if ((limit != 0) && (limit < sites.size()))
+  {
+    std::partial_sort(sites.begin(), sites.begin() + limit, sites.end(), larger);
+    sites.resize(limit);
+  }
+  else
+  {
+    std::sort(sites.begin(), sites.end(), larger);
+  }
+}
 
-            fprintf(f, "%s Address %p is %ld bytes after a block of size %ld alloc'd at:\n",
-                    hu_prefix, ptr, offset, allocation->second.size);
+/* Take a timeline snapshot if enough bytes were allocated, or time passed */
+static inline void log_timeline_poll()
+{
+  if (allocinfo_total_alloc_bytes.load(std::memory_order_relaxed) <
+      log_timeline_next_bytes.load(std::memory_order_relaxed))
+  {
+    if ((hu_log_timeline_ms == 0) || (--log_timeline_countdown > 0)) return;
 
-            log_print_callstack(f, allocation->second.callstack_depth, allocation->second.callstack);
-            break;
-          }
-        }
+    log_timeline_countdown = LOG_TIMELINE_CLOCK_STEP;
+    if (hu_timeline_time_ms() < log_timeline_next_ms.load(std::memory_order_relaxed)) return;
+  }
 
-        /* Search freed allocations if not found in active */
-        if (!found)
-        {
-          for (auto allocation = freed_allocations->begin(); allocation != freed_allocations->end(); ++allocation)
-          {
-            if ((ptr >= ((char*)allocation->second.ptr + allocation->second.size)) &&
-                (ptr <= ((char*)allocation->second.ptr + allocation->second.size + hu_page_size)))
-            {
-              found = true;
-              size_t offset = (char*)ptr - ((char*)allocation->second.ptr + allocation->second.size);
-
-              fprintf(f, "%s Address %p is %ld bytes after a block of size %ld free'd at:\n",
-                      hu_prefix, ptr, offset, allocation->second.size);
-
-              log_print_callstack(f, allocation->second.free_callstack_depth,
-                                  allocation->second.free_callstack);
-
-              fprintf(f, "%s Block was alloc'd at:\n", hu_prefix);
-              log_print_callstack(f, allocation->second.callstack_depth, allocation->second.callstack);
-              break;
-            }
-            else if ((ptr >= ((char*)allocation->second.ptr)) &&
-                     (ptr <= ((char*)allocation->second.ptr + allocation->second.size + hu_page_size)))
-            {
-              found = true;
-              size_t offset = (char*)ptr - ((char*)allocation->second.ptr);
-
-              fprintf(f, "%s Address %p is %ld bytes inside a block of size %ld free'd at:\n",
-                      hu_prefix, ptr, offset, allocation->second.size);
-
-              log_print_callstack(f, allocation->second.free_callstack_depth,
-                                  allocation->second.free_callstack);
-
-              fprintf(f, "%s Block was alloc'd at:\n", hu_prefix);
-              log_print_callstack(f, allocation->second.callstack_depth, allocation->second.callstack);
-              break;
-            }
-          }
-        }
+  log_timeline_snapshot(false);
+}
 
-        fprintf(f, "%s\n", hu_prefix);
+/*
+ * Take a lock from a fault handler, which may have interrupted its holder.
+ * Gives up after a bounded wait, in which case the caller does without it.
+ */
+static bool log_fault_lock(std::mutex& mutex)
+{
+  struct timespec interval = { 0, LOG_FAULT_LOCK_POLL_NS };
+  for (int i = 0; i < LOG_FAULT_LOCK_POLLS; ++i)
+  {
+    if (mutex.try_lock()) return true;
 
-        fclose(f);
-      }
-    }
+    nanosleep(&interval, nullptr);
   }
 
-  hu_set_bypass(false);
-
-  exit(EXIT_FAILURE);
+  return false;
 }
 
-void log_summary(bool ondemand)
+/*
+ * Look up tracked block by its pointer, active or free'd, from a fault
+ * handler. Sets locked if the block could not be looked up, as its shard
+ * lock is held.
+ */
+static bool log_find_block(void* ptr, hu_allocinfo_t* allocinfo, bool* freed, bool* locked)
 {
-  FILE* f = nullptr;
-  if (hu_log_file != nullptr)
+  if (ptr == nullptr) return false;
+
+  hu_log_shard& shard = log_shard(ptr);
+  if (!log_fault_lock(shard.mutex))
   {
-    f = fopen(hu_log_file, "a");
+    *locked = true;
+    return false;
   }
 
-  if (f == nullptr)
+  std::lock_guard<std::mutex> lock(shard.mutex, std::adopt_lock);
+  const hu_allocinfo_t* info = shard.allocations.find(ptr);
+  *freed = (info == nullptr);
+  if (info == nullptr)
   {
-    return;
+    const hu_freedinfo_t* freedinfo = shard.freed_allocations.find(ptr);
+    if (freedinfo == nullptr) return false;
+
+    info = &freedinfo->allocinfo;
   }
 
+  *allocinfo = *info;
+  return true;
+}
+
+/* Distance in bytes from block to accessed address, zero if inside it */
+static inline size_t log_access_distance(void* addr, const hu_allocinfo_t& allocinfo)
+{
+  char* start = (char*)allocinfo.ptr;
+  char* end = start + allocinfo.size;
+  if ((char*)addr < start) return (size_t)(start - (char*)addr);
+
+  return ((char*)addr >= end) ? (size_t)((char*)addr - end) : 0;
+}
+
+#if !defined(__APPLE__)
+/*
+ * Loaded object files, with extent of their loaded segments, load base and
+ * GNU build-id (hex, empty if none). Used to map addresses to object file
+ * offsets, and output as module map for offline symbolization.
+ */
+struct log_module
+{
+  uintptr_t start;
+  uintptr_t end;
+  uintptr_t base;
+  std::string path;
+  std::string build_id;
+};
+
+static std::string log_get_build_id(struct dl_phdr_info* info)
+{
+  static const char hex[] = "0123456789abcdef";
+  for (int i = 0; i < info->dlpi_phnum; ++i)
+  {
+    const ElfW(Phdr)& phdr = info->dlpi_phdr[i];
+    if (phdr.p_type != PT_NOTE) continue;
+
+    const char* note = (const char*)(info->dlpi_addr + phdr.p_vaddr);
+    const char* note_end = note + phdr.p_memsz;
+    while ((note + sizeof(ElfW(Nhdr))) <= note_end)
+    {
+      const ElfW(Nhdr)* nhdr = (const ElfW(Nhdr)*)note;
+      const char* name = note + sizeof(ElfW(Nhdr));
+      const unsigned char* desc = (const unsigned char*)(name + ((nhdr->n_namesz + 3) & ~3U));
+      if ((nhdr->n_type == NT_GNU_BUILD_ID) && (nhdr->n_namesz == 4) && (memcmp(name, "GNU", 4) == 0))
+      {
+        std::string build_id;
+        for (size_t j = 0; j < nhdr->n_descsz; ++j)
+        {
+          build_id += hex[desc[j] >> 4];
+          build_id += hex[desc[j] & 0xf];
+        }
+
+        return build_id;
+      }
+
+      note = (const char*)desc + ((nhdr->n_descsz + 3) & ~3U);
+    }
+  }
+
+  return std::string();
+}
+
+static int log_collect_module(struct dl_phdr_info* info, size_t /*size*/, void* data)
+{
+  std::vector<log_module>* modules = (std::vector<log_module>*)data;
+  log_module module;
+  module.start = UINTPTR_MAX;
+  module.end = 0;
+  module.base = info->dlpi_addr;
+  for (int i = 0; i < info->dlpi_phnum; ++i)
+  {
+    const ElfW(Phdr)& phdr = info->dlpi_phdr[i];
+    if (phdr.p_type == PT_LOAD)
+    {
+      module.start = std::min(module.start, (uintptr_t)(info->dlpi_addr + phdr.p_vaddr));
+      module.end = std::max(module.end, (uintptr_t)(info->dlpi_addr + phdr.p_vaddr + phdr.p_memsz));
+    }
+  }
+
+  if (module.start >= module.end) return 0;
+
+  /* Main program is reported without name */
+  if ((info->dlpi_name != nullptr) && info->dlpi_name[0])
+  {
+    module.path = info->dlpi_name;
+  }
+  else
+  {
+    char path[PATH_MAX] = { 0 };
+    if (readlink("/proc/self/exe", path, sizeof(path) - 1) > 0)
+    {
+      module.path = path;
+    }
+  }
+
+  module.build_id = log_get_build_id(info);
+  modules->push_back(module);
+  return 0;
+}
+
+static std::vector<log_module> log_get_modules()
+{
+  std::vector<log_module> modules;
+  dl_iterate_phdr(log_collect_module, &modules);
+  std::sort(modules.begin(), modules.end(),
+            [](const log_module& lhs, const log_module& rhs) { return lhs.start < rhs.start; });
+  return modules;
+}
+
+static void log_print_module_map(const std::vector<log_module>& modules)
+{
+  hu_writer_printf("%sMODULE MAP:\n", hu_prefix);
+  for (const log_module& module : modules)
+  {
+    hu_writer_printf("%s   0x%016" PRIxPTR "-0x%016" PRIxPTR " 0x%016" PRIxPTR " %s %s\n", hu_prefix,
+            module.start, module.end, module.base,
+            module.build_id.empty() ? "-" : module.build_id.c_str(), module.path.c_str());
+  }
+
+  hu_writer_printf("%s\n", hu_prefix);
+}
+#endif
+
+/*
+ * Report state read before writing a report, with all shard locks held. A
+ * forked report child has everything it needs that would take locks.
+ */
+struct log_report_state
+{
   unsigned long long leak_total_bytes = 0;
   unsigned long long leak_total_blocks = 0;
+  unsigned long long history_blocks = 0;
+  unsigned long long history_bytes = 0;
+  unsigned long long history_aged_out = 0;
+  std::vector<hu_siteinfo_t> peak_sites;
+  unsigned long long peak_bytes = 0;
+  unsigned long long peak_blocks = 0;
+  hu_quarantine_stats quarantine;
+#if !defined(__APPLE__)
+  std::vector<log_module> modules;
+#endif
+};
+
+
+/* ----------- Global Functions ---------------------------------- */
+void log_init(const hu_log_config& config)
+{
+  /* Config */
+  hu_log_file = config.file;
+  hu_log_free = config.doublefree;
+  hu_log_nosyms = config.nosyms;
+  hu_log_minleak = config.minsize;
+  hu_useafterfree = config.useafterfree;
+  hu_leak = config.leak;
+  hu_log_repeat = config.log_repeat;
+  hu_log_report_fork = config.report_fork;
+
+  /* Get runtime info */
+  pid = getpid();
+
+  /* Set up log line prefix */
+  if (config.log_pid_prefix)
+  {
+    snprintf(hu_prefix, sizeof(hu_prefix), "==%d== ", pid);
+  }
+
+  /* Initial log output */
+  if (hu_log_file != nullptr)
+  {
+    if (hu_writer_open(hu_log_file))
+    {
+      const char* hu_version = getenv("HU_VERSION");
+      if ((hu_version != nullptr) && hu_version[0])
+      {
+        hu_writer_printf("%sHeapusage v%s - https://github.com/d99kris/heapusage\n", hu_prefix, hu_version);
+      }
+      else
+      {
+        hu_writer_printf("%sHeapusage - https://github.com/d99kris/heapusage\n", hu_prefix);
+      }
+      hu_writer_printf("%sCommand: %s\n", hu_prefix, (config.command != nullptr) ? config.command : "");
+      hu_writer_printf("%sProcess: %d\n", hu_prefix, pid);
+      hu_writer_printf("%s\n", hu_prefix);
+      hu_writer_flush();
+    }
+    else
+    {
+      fprintf(stderr, "heapusage error: unable to open output file (%s) for writing\n", hu_log_file);
+    }
+  }
+  else
+  {
+    fprintf(stderr, "heapusage error: no output file specified\n");
+  }
+
+  log_shards = new hu_log_shard[config.shards];
+  log_shard_mask = config.shards - 1;
+  log_report_mutex = new std::mutex();
+  symbol_cache = new std::unordered_map<void*, std::string>();
+#if LOG_HAS_RESOLVER
+  trace_resolver = new backward::TraceResolver();
+  module_symbol_cache = new std::unordered_map<uint64_t, std::string>();
+  module_ids = new std::map<std::string, uint64_t>();
+#endif
+  objfile_cache = new std::map<void*, std::string>();
+  reported_invalid_dealloc_callstacks = new std::set<uint32_t>();
+  reported_invalid_access_callstacks = new std::set<uint32_t>();
+  reported_mismatched_dealloc_callstacks = new std::set<uint32_t>();
+  hu_stack_init();
+
+  /* Count blocks in use per allocation site, for leak and timeline reports */
+  if (config.leak || (config.timeline_file != nullptr))
+  {
+    hu_log_leak_sites = config.leak_sites;
+    hu_log_sites = true;
+  }
+
+  /* Capture the sites in use at peak heap usage, for the peak summary */
+  if (config.peak && config.leak)
+  {
+    log_peak_mutex = new std::mutex();
+    log_peak_sites = new std::vector<hu_siteinfo_t>();
+    hu_log_peak = true;
+  }
+
+  /* Bound free'd blocks kept for double-free detection, split evenly over shards */
+  if (config.doublefree && (config.free_history != 0))
+  {
+    hu_log_history_capacity = (config.free_history + log_shard_mask) / config.shards;
+    hu_log_history_max_bytes = (config.free_history_bytes + log_shard_mask) / config.shards;
+    const size_t history_size = hu_log_history_capacity * sizeof(hu_history_entry_t);
+    void* mem = mmap(nullptr, history_size * config.shards, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+                     -1, 0);
+    if (mem != MAP_FAILED)
+    {
+      for (size_t i = 0; i < config.shards; ++i)
+      {
+        log_shards[i].history = (hu_history_entry_t*)((char*)mem + (i * history_size));
+      }
+    }
+    else
+    {
+      fprintf(stderr, "heapusage error: unable to map free history, keeping all free'd blocks\n");
+    }
+  }
+
+  /* Sampled tracking, if requested */
+  if (config.sample_rate != 0)
+  {
+    void* mem = mmap(nullptr, LOG_SAMPLE_FILTER_SIZE * sizeof(std::atomic<uint32_t>), PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem != MAP_FAILED)
+    {
+      log_sample_filter = (std::atomic<uint32_t>*)mem;
+      hu_log_sample_rate = config.sample_rate;
+    }
+    else
+    {
+      fprintf(stderr, "heapusage error: unable to map sample filter, tracking all allocations\n");
+    }
+  }
+
+  /* Record all events to binary trace, if requested */
+  if (config.trace_file != nullptr)
+  {
+    if (hu_trace_init(config.trace_file))
+    {
+      hu_log_trace_file = config.trace_file;
+      hu_log_trace_only = config.trace_only;
+    }
+    else
+    {
+      fprintf(stderr, "heapusage error: unable to open trace file (%s) for writing\n", config.trace_file);
+    }
+  }
+
+  /* Record heap usage timeline, if requested */
+  if (config.timeline_file != nullptr)
+  {
+    if (hu_timeline_init(config.timeline_file, config.timeline_snapshots))
+    {
+      hu_log_command = config.command;
+      hu_log_timeline_file = config.timeline_file;
+      hu_log_timeline_bytes = config.timeline_bytes;
+      hu_log_timeline_ms = config.timeline_ms;
+      hu_log_timeline_top = std::min(config.timeline_top, (size_t)HU_TIMELINE_MAX_SITES);
+      log_timeline_mutex = new std::mutex();
+      log_timeline_next_bytes = (config.timeline_bytes != 0) ? config.timeline_bytes : ULLONG_MAX;
+      log_timeline_next_ms = (config.timeline_ms != 0) ? config.timeline_ms : ULLONG_MAX;
+      hu_log_timeline = true;
+    }
+    else
+    {
+      fprintf(stderr, "heapusage error: unable to open timeline file (%s) for writing\n", config.timeline_file);
+    }
+  }
+
+  /* Apply events from per-thread buffers on a collector thread, if requested */
+  if (config.async)
+  {
+    hu_log_async = hu_event_init(log_apply_event);
+  }
+}
+
+void log_enable(int flag)
+{
+  log_event_handler = flag ? log_select_handler() : log_ignore_event;
+}
+
+void log_print_callstack(int callstack_depth, void* const callstack[])
+{
+  if (callstack_depth > 0)
+  {
+    int i = 1;
+    while (i < callstack_depth)
+    {
+#if UINTPTR_MAX == 0xffffffff
+      hu_writer_printf("%s   at 0x%08x", hu_prefix, (unsigned int)callstack[i]);
+#else
+      hu_writer_printf("%s   at 0x%016" PRIxPTR, hu_prefix, (unsigned long)callstack[i]);
+#endif
+
+      if (hu_log_nosyms)
+      {
+        hu_writer_printf("\n");
+      }
+      else
+      {
+        std::string symbol = addr_to_symbol(callstack[i]);
+        hu_writer_printf(": %s\n", symbol.empty() ? "???" : symbol.c_str());
+      }
+
+      ++i;
+    }
+  }
+  else
+  {
+    hu_writer_printf("%s   error: backtrace() returned empty callstack\n", hu_prefix);
+  }
+}
+
+void log_print_stack(uint32_t callstack_id)
+{
+  void* const* callstack = nullptr;
+  int callstack_depth = hu_stack_get(callstack_id, &callstack);
+  log_print_callstack(callstack_depth, callstack);
+}
+
+bool log_is_valid_callstack(int callstack_depth, void* const callstack[], bool is_alloc)
+{
+  int i = callstack_depth - 1;
+  std::string objfile;
+  while (i > 0)
+  {
+    void* addr = callstack[i];
+
+    auto it = objfile_cache->find(addr);
+    if (it != objfile_cache->end())
+    {
+      objfile = it->second;
+    }
+    else if (!log_in_report_child)
+    {
+      Dl_info dlinfo;
+      if (dladdr(addr, &dlinfo) && (dlinfo.dli_fname != nullptr))
+      {
+        char* fname = strdup(dlinfo.dli_fname);
+        if (fname != nullptr)
+        {
+          objfile = std::string(basename(fname));
+          (*objfile_cache)[addr] = objfile;
+          free(fname);
+        }
+      }
+    }
+
+    if (!objfile.empty())
+    {
+      // For now only care about originating object file
+      break;
+    }
+
+    --i;
+  }
+
+  if (!objfile.empty())
+  {
+    // ignore invalid dealloc from libobjc
+    if (!is_alloc && (objfile == "libobjc.A.dylib")) return false;
+  }
+
+  return true;
+}
+
+bool log_is_valid_stack(uint32_t callstack_id, bool is_alloc)
+{
+  void* const* callstack = nullptr;
+  int callstack_depth = hu_stack_get(callstack_id, &callstack);
+  return log_is_valid_callstack(callstack_depth, callstack, is_alloc);
+}
+
+void hu_sig_handler(int sig, siginfo_t* si, void* /*ucontext*/)
+{
+  if ((sig != SIGSEGV) && (sig != SIGBUS)) return;
+
+  hu_set_bypass(true);
+
+  /* Always backtrace(), as frame pointers do not chain through the signal frame */
+  void* ptr = si->si_addr;
+  void* callstack[MAX_CALL_STACK];
+  int callstack_depth = backtrace(callstack, MAX_CALL_STACK);
+
+  /* The fault may have interrupted a report, in which case output is not serialized */
+  std::unique_lock<std::mutex> report_lock(*log_report_mutex, std::defer_lock);
+  if (log_fault_lock(*log_report_mutex))
+  {
+    report_lock = std::unique_lock<std::mutex>(*log_report_mutex, std::adopt_lock);
+    log_report_wait();
+  }
+
+  if (log_is_valid_callstack(callstack_depth, callstack, false))
+  {
+    total_invalid_access_count++;
+    const uint32_t callstack_id = hu_stack_intern(callstack, callstack_depth);
+    bool is_new = reported_invalid_access_callstacks->insert(callstack_id).second;
+    if (is_new || hu_log_repeat)
+    {
+      if (hu_writer_is_open())
+      {
+        hu_writer_printf("%sInvalid memory access at:\n", hu_prefix);
+
+        log_print_callstack(callstack_depth, callstack);
+
+        /* Classify access against the block on the faulting page, or the one starting after it */
+        void* owner = nullptr;
+        void* next = nullptr;
+        hu_malloc_find_blocks(ptr, &owner, &next);
+
+        hu_allocinfo_t block;
+        bool freed = false;
+        bool locked = false;
+        bool found = log_find_block(owner, &block, &freed, &locked);
+        hu_allocinfo_t next_block;
+        bool next_freed = false;
+        if (log_find_block(next, &next_block, &next_freed, &locked) &&
+            (!found || (log_access_distance(ptr, next_block) < log_access_distance(ptr, block))))
+        {
+          found = true;
+          block = next_block;
+          freed = next_freed;
+        }
+
+        if (found)
+        {
+          const char* state = freed ? "free'd" : "alloc'd";
+          if (ptr < block.ptr)
+          {
+            hu_writer_printf("%s Address %p is %ld bytes before a block of size %ld %s at:\n",
+                             hu_prefix, ptr, (long)((char*)block.ptr - (char*)ptr), block.size, state);
+          }
+          else if (ptr >= ((char*)block.ptr + block.size))
+          {
+            hu_writer_printf("%s Address %p is %ld bytes after a block of size %ld %s at:\n",
+                             hu_prefix, ptr, (long)((char*)ptr - ((char*)block.ptr + block.size)),
+                             block.size, state);
+          }
+          else
+          {
+            hu_writer_printf("%s Address %p is %ld bytes inside a block of size %ld %s at:\n",
+                             hu_prefix, ptr, (long)((char*)ptr - (char*)block.ptr), block.size, state);
+          }
+
+          if (freed)
+          {
+            log_print_stack(block.free_callstack_id);
+
+            hu_writer_printf("%s Block was alloc'd at:\n", hu_prefix);
+          }
+
+          log_print_stack(block.callstack_id);
+        }
+        else if (locked)
+        {
+          /* Only the page owner index is available without locks */
+          hu_writer_printf("%s Address %p is near block %p, not looked up as its tracking state is locked\n",
+                           hu_prefix, ptr, (owner != nullptr) ? owner : next);
+        }
+
+        hu_writer_printf("%s\n", hu_prefix);
+
+        /* Flush now, in case the process does not make it through exit() */
+        hu_writer_flush();
+      }
+    }
+  }
+
+  /* Release before exit(), as hu_fini() also takes the report lock */
+  if (report_lock.owns_lock())
+  {
+    report_lock.unlock();
+  }
+  hu_set_bypass(false);
+
+  exit(EXIT_FAILURE);
+}
+
+void log_summary(bool ondemand)
+{
+  /* Apply all buffered events before reporting */
+  hu_event_flush();
+
+  std::lock_guard<std::mutex> report_lock(*log_report_mutex);
+  if (!hu_writer_is_open())
+  {
+    return;
+  }
+
+  /* Let a forked report finish, so that reports are not interleaved */
+  log_report_wait();
+
+  /* Timeline ends with heap usage at exit */
+  if (hu_log_timeline && !ondemand)
+  {
+    log_timeline_snapshot(true);
+  }
+
+  /* Write out trace, with loaded objects for symbolization of call stacks */
+  if (hu_log_trace_file != nullptr)
+  {
+#if !defined(__APPLE__)
+    if (!ondemand)
+    {
+      std::vector<log_module> modules = log_get_modules();
+      for (const log_module& module : modules)
+      {
+        hu_trace_module(module.start, module.end, module.base, module.build_id.c_str(), module.path.c_str());
+      }
+    }
+#endif
+
+    hu_trace_flush();
+  }
+
+  const bool fork_report = ondemand && hu_log_report_fork;
+  log_report_state state;
+  if (hu_useafterfree)
+  {
+    hu_quarantine_get_stats(&state.quarantine);
+  }
+
+#if !defined(__APPLE__)
+  if (hu_log_nosyms)
+  {
+    state.modules = log_get_modules();
+  }
+#endif
+
+  /* Resolve what a forked report child will output, sites added meanwhile are output as unresolved */
+  if (fork_report)
+  {
+    std::vector<hu_siteinfo_t> leak_sites;
+    log_get_leak_sites(leak_sites);
+    std::vector<hu_siteinfo_t> peak_sites;
+    if (hu_log_peak)
+    {
+      std::lock_guard<std::mutex> peak_lock(*log_peak_mutex);
+      peak_sites = *log_peak_sites;
+    }
+
+    log_top_sites(peak_sites, LOG_PEAK_SITES);
+    log_prepare_sites(leak_sites, peak_sites);
+  }
+
+  /* Hold all shard locks, so that totals, history and site counters are consistent */
+  for (size_t i = 0; i <= log_shard_mask; ++i)
+  {
+    log_shards[i].mutex.lock();
+  }
+
+  state.leak_total_bytes = allocinfo_current_alloc_bytes.load();
+  state.leak_total_blocks = log_block_count(allocinfo_current_alloc_blocks.load());
+  for (size_t i = 0; i <= log_shard_mask; ++i)
+  {
+    if (log_shards[i].history != nullptr)
+    {
+      state.history_blocks += log_shards[i].freed_allocations.size();
+      state.history_bytes += log_shards[i].history_bytes;
+      state.history_aged_out += log_shards[i].history_aged_out;
+    }
+  }
+
+  if (hu_log_peak)
+  {
+    std::lock_guard<std::mutex> peak_lock(*log_peak_mutex);
+    state.peak_sites = *log_peak_sites;
+    state.peak_bytes = log_peak_bytes;
+    state.peak_blocks = log_peak_blocks;
+  }
+
+  /*
+   * Fork the on-demand report writer while the locks are held. The child has
+   * no other threads, so it reads the tracking state without locks, and must
+   * only exit with _exit() so that no destructors or atexit handlers run.
+   */
+  pid_t child = -1;
+  if (fork_report)
+  {
+    hu_writer_flush();
+    child = log_report_spawn();
+  }
+
+  for (size_t i = 0; i <= log_shard_mask; ++i)
+  {
+    log_shards[i].mutex.unlock();
+  }
+
+  if (child == 0)
+  {
+    log_in_report_child = true;
+#if defined(__linux__)
+    if (!hu_use_private_heap())
+    {
+      /* The system allocator cannot be used, as it may have been locked when cloned */
+      static const char msg[] = "heapusage error: unable to map report child heap, report not written\n";
+      ssize_t rv = write(STDERR_FILENO, msg, sizeof(msg) - 1);
+      (void)rv;
+      _exit(EXIT_FAILURE);
+    }
+#endif
+    log_write_summary(ondemand, state);
+    _exit(EXIT_SUCCESS);
+  }
+  else if (child > 0)
+  {
+    log_report_child = child;
+    return;
+  }
+
+  log_write_summary(ondemand, state);
+}
+
+void hu_log_remove_freed_allocation(void* ptr)
+{
+  if (!hu_log_free)
+  {
+    hu_log_shard& shard = log_shard(ptr);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    log_freed_erase(shard, ptr, nullptr);
+  }
+}
+
+
+/* ----------- Local Functions ----------------------------------- */
+/* Sites in use, of at least minimum size, largest first */
+static void log_get_leak_sites(std::vector<hu_siteinfo_t>& sites)
+{
+  if (!hu_leak) return;
+
+  log_get_sites(sites);
+  sites.erase(std::remove_if(sites.begin(), sites.end(),
+                             [](const hu_siteinfo_t& site) { return site.size < hu_log_minleak; }),
+              sites.end());
+  log_top_sites(sites, hu_log_leak_sites);
+}
+
+/* Symbolize all frames of sites to be output in one pass, and look up their object files */
+static void log_prepare_sites(const std::vector<hu_siteinfo_t>& leak_sites,
+                              const std::vector<hu_siteinfo_t>& peak_sites)
+{
+  std::unordered_set<void*> unique_addrs;
+  for (const std::vector<hu_siteinfo_t>* sites : { &leak_sites, &peak_sites })
+  {
+    for (const hu_siteinfo_t& site : *sites)
+    {
+      void* const* callstack = nullptr;
+      int callstack_depth = hu_stack_get(site.callstack_id, &callstack);
+      unique_addrs.insert(callstack + std::min(callstack_depth, 1), callstack + callstack_depth);
+      log_is_valid_stack(site.callstack_id, true);
+    }
+  }
+
+  if (!hu_log_nosyms)
+  {
+    log_resolve_symbols(std::vector<void*>(unique_addrs.begin(), unique_addrs.end()));
+  }
+}
+
+/*
+ * log_report_spawn forks a report child. On Linux it is cloned without a
+ * signal to the parent when it exits, and without running fork handlers, so
+ * that it is not visible to the application. A plain fork() is not enough:
+ * it runs the application's pthread_atfork() handlers, which may take its
+ * locks, and SIGCHLD is process-directed, so masking it in the reporting
+ * thread does not keep it from other threads, nor keep waitpid(-1) from
+ * reaping the child. The clone skips glibc's fork bookkeeping, so the child
+ * must avoid anything it resets: it allocates from a private heap instead of
+ * the malloc arenas, writes through the raw writer descriptor rather than
+ * stdio, takes no mutexes as its only thread, and does not resolve symbols.
+ */
+static pid_t log_report_spawn()
+{
+#if defined(__linux__)
+  return (pid_t)syscall(SYS_clone, 0, nullptr, nullptr, nullptr, nullptr);
+#else
+  return fork();
+#endif
+}
+
+/*
+ * log_write_summary outputs a report of state and the site counters. Caller
+ * must hold log_report_mutex, or be the only thread of a forked child.
+ */
+static void log_write_summary(bool ondemand, const log_report_state& state)
+{
+  std::vector<hu_siteinfo_t> leak_sites;
+  log_get_leak_sites(leak_sites);
+
+  /* Indicate in case an on-demand report */
+  if (ondemand)
+  {
+    hu_writer_printf("%sON DEMAND REPORT\n", hu_prefix);
+  }
+
+  /* Output error summary */
+  if (total_invalid_dealloc_count > 0 || total_invalid_access_count > 0 || total_mismatched_dealloc_count > 0)
+  {
+    hu_writer_printf("%sERROR SUMMARY:\n", hu_prefix);
+    hu_writer_printf("%s     deallocations: %llu unique (%llu total)\n", hu_prefix,
+            (unsigned long long)reported_invalid_dealloc_callstacks->size(),
+            total_invalid_dealloc_count);
+    hu_writer_printf("%s     memory access: %llu unique (%llu total)\n", hu_prefix,
+            (unsigned long long)reported_invalid_access_callstacks->size(),
+            total_invalid_access_count);
+    hu_writer_printf("%s   mismatched free: %llu unique (%llu total)\n", hu_prefix,
+            (unsigned long long)reported_mismatched_dealloc_callstacks->size(),
+            total_mismatched_dealloc_count);
+    hu_writer_printf("%s\n", hu_prefix);
+  }
+
+  /* Trace only mode does not track blocks, output totals and trace info */
+  if (hu_log_trace_only)
+  {
+    hu_writer_printf("%sHEAP SUMMARY:\n", hu_prefix);
+    hu_writer_printf("%s  total heap usage: %llu allocs, %llu frees, %llu bytes allocated\n",
+            hu_prefix, allocinfo_total_allocs.load(), allocinfo_total_frees.load(),
+            allocinfo_total_alloc_bytes.load());
+    hu_writer_printf("%s\n", hu_prefix);
+    hu_writer_printf("%sTRACE SUMMARY:\n", hu_prefix);
+    hu_writer_printf("%s        trace file: %s\n", hu_prefix, hu_log_trace_file);
+    hu_writer_printf("%s    events written: %llu\n", hu_prefix, hu_trace_event_count());
+    hu_writer_printf("%s\n", hu_prefix);
+    hu_writer_flush();
+    return;
+  }
+
+  /* Output heap summary */
+  hu_writer_printf("%sHEAP SUMMARY:\n", hu_prefix);
+  hu_writer_printf("%s    in use at exit: %llu bytes in %llu blocks\n",
+          hu_prefix, state.leak_total_bytes, state.leak_total_blocks);
+  hu_writer_printf("%s  total heap usage: %llu allocs, %llu frees, %llu bytes allocated\n",
+          hu_prefix, allocinfo_total_allocs.load(), allocinfo_total_frees.load(),
+          allocinfo_total_alloc_bytes.load());
+  hu_writer_printf("%s   peak heap usage: %llu bytes allocated\n",
+          hu_prefix, allocinfo_peak_alloc_bytes.load());
+  if (hu_log_sample_rate != 0)
+  {
+    hu_writer_printf("%s  sampling interval: %zu bytes (in use, peak and lost are estimates)\n",
+            hu_prefix, hu_log_sample_rate);
+  }
+  hu_writer_printf("%s\n", hu_prefix);
+
+  /* Largest allocation sites at peak */
+  std::vector<hu_siteinfo_t> peak_sites = state.peak_sites;
+  log_top_sites(peak_sites, LOG_PEAK_SITES);
+
+  /* Output leak details */
+  if (hu_leak)
+  {
+    log_prepare_sites(leak_sites, peak_sites);
+
+    /* Output peak summary and details, largest sites first */
+    if (hu_log_peak)
+    {
+      hu_writer_printf("%sPEAK SUMMARY:\n", hu_prefix);
+      hu_writer_printf("%s    in use at peak: %llu bytes in %llu blocks\n", hu_prefix, state.peak_bytes,
+                       state.peak_blocks);
+      hu_writer_printf("%s\n", hu_prefix);
+
+      for (const hu_siteinfo_t& site : peak_sites)
+      {
+        if (log_is_valid_stack(site.callstack_id, true))
+        {
+          hu_writer_printf("%s%zu bytes in %llu block(s) are in use at peak, allocated at:\n", hu_prefix,
+                           site.size, site.count);
+
+          log_print_stack(site.callstack_id);
+
+          hu_writer_printf("%s\n", hu_prefix);
+        }
+      }
+    }
+
+    for (const hu_siteinfo_t& site : leak_sites)
+    {
+      if (log_is_valid_stack(site.callstack_id, true))
+      {
+        hu_writer_printf("%s%zu bytes in %llu block(s) are lost, originally allocated at:\n", hu_prefix, site.size,
+                         site.count);
+
+        log_print_stack(site.callstack_id);
+
+        hu_writer_printf("%s\n", hu_prefix);
+      }
+    }
+  }
+
+  /* Output leak summary */
+  hu_writer_printf("%sLEAK SUMMARY:\n", hu_prefix);
+  hu_writer_printf("%s   definitely lost: %llu bytes in %llu blocks\n", hu_prefix,
+          state.leak_total_bytes, state.leak_total_blocks);
+  hu_writer_printf("%s\n", hu_prefix);
+
+  if (hu_useafterfree)
+  {
+    const hu_quarantine_stats& quarantine = state.quarantine;
+    hu_writer_printf("%sQUARANTINE SUMMARY:\n", hu_prefix);
+    hu_writer_printf("%s       quarantined: %llu blocks, %llu bytes\n", hu_prefix,
+                     quarantine.blocks, quarantine.bytes);
+    hu_writer_printf("%s           evicted: %llu blocks, %llu bytes\n", hu_prefix,
+                     quarantine.evicted_blocks, quarantine.evicted_bytes);
+    hu_writer_printf("%s     in quarantine: %llu bytes virtual, %llu bytes resident\n", hu_prefix,
+                     quarantine.virtual_bytes, quarantine.resident_bytes);
+    hu_writer_printf("%s\n", hu_prefix);
+  }
+
+  if (hu_log_history_capacity != 0)
+  {
+    hu_writer_printf("%sFREE HISTORY SUMMARY:\n", hu_prefix);
+    hu_writer_printf("%s        in history: %llu blocks, %llu bytes\n", hu_prefix,
+                     state.history_blocks, state.history_bytes);
+    hu_writer_printf("%s          aged out: %llu blocks\n", hu_prefix, state.history_aged_out);
+    hu_writer_printf("%s\n", hu_prefix);
+  }
+
+  /* Write out timeline, which is only complete at exit */
+  if (hu_log_timeline && !ondemand)
+  {
+    if (!hu_log_nosyms)
+    {
+      std::vector<void*> addrs;
+      for (uint32_t site_id : hu_timeline_site_ids())
+      {
+        void* const* callstack = nullptr;
+        int callstack_depth = hu_stack_get(site_id, &callstack);
+        addrs.insert(addrs.end(), callstack + std::min(callstack_depth, 1), callstack + callstack_depth);
+      }
+
+      std::sort(addrs.begin(), addrs.end());
+      addrs.erase(std::unique(addrs.begin(), addrs.end()), addrs.end());
+      log_resolve_symbols(addrs);
+    }
+
+    hu_timeline_write(hu_log_command, hu_log_nosyms ? nullptr : addr_to_symbol);
+    hu_writer_printf("%sTIMELINE SUMMARY:\n", hu_prefix);
+    hu_writer_printf("%s         snapshots: %zu (%llu coalesced)\n", hu_prefix,
+                     hu_timeline_snapshot_count(), hu_timeline_coalesced_count());
+    hu_writer_printf("%s     timeline file: %s\n", hu_prefix, hu_log_timeline_file);
+    hu_writer_printf("%s\n", hu_prefix);
+  }
+
+  if (hu_useafterfree && hu_quarantine_was_evicted())
+  {
+    hu_writer_printf("%sWARNING: use-after-free tracking incomplete, quarantine memory limit exceeded\n", hu_prefix);
+    hu_writer_printf("%s\n", hu_prefix);
+  }
+
+#if !defined(__APPLE__)
+  /* Output loaded objects, for offline symbolization of raw addresses */
+  if (hu_log_nosyms)
+  {
+    log_print_module_map(state.modules);
+  }
+#endif
+
+  hu_writer_flush();
+}
+
+static void log_report_wait()
+{
+  if (log_report_child > 0)
+  {
+    while ((waitpid(log_report_child, nullptr, LOG_REPORT_WAIT_FLAGS) == -1) && (errno == EINTR))
+    {
+    }
+
+    log_report_child = 0;
+  }
+}
+
+template <bool TRACK_FREED>
+static void log_malloc(void* ptr, size_t size, uint32_t callstack_id, int kind)
+{
+  hu_allocinfo_t allocinfo;
+  unsigned long long current = 0;
+  bool track = (size >= hu_log_minleak);
+  if (track)
+  {
+    allocinfo.size = size;
+    allocinfo.ptr = ptr;
+    allocinfo.callstack_id = callstack_id;
+    allocinfo.free_callstack_id = HU_STACK_ID_NONE;
+    allocinfo.kind = kind;
+  }
+
+  {
+    hu_log_shard& shard = log_shard(ptr);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    if (TRACK_FREED)
+    {
+      log_freed_erase(shard, ptr, nullptr);
+    }
+
+    if (track && !shard.allocations.insert(ptr, allocinfo))
+    {
+      track = false;
+    }
+
+    /* Counted under the shard lock, like in log_free, for consistent reports */
+    if (track)
+    {
+      current = (allocinfo_current_alloc_bytes += log_scaled_size(size));
+      allocinfo_current_alloc_blocks += log_scaled_count(size);
+      if (hu_log_sites)
+      {
+        hu_stack_add_live(callstack_id, log_scaled_size(size), log_scaled_count(size));
+      }
+    }
+  }
+
+  if (track)
+  {
+    if (hu_log_sample_rate == 0)
+    {
+      allocinfo_total_allocs += 1;
+      allocinfo_total_alloc_bytes += size;
+    }
+    else
+    {
+      log_sample_filter_count(ptr) += 1;
+    }
+
+    log_update_peak(current);
+    if (hu_log_peak && (current > log_peak_threshold.load(std::memory_order_relaxed)))
+    {
+      log_peak_capture(current);
+    }
+
+    if (hu_log_timeline)
+    {
+      log_timeline_poll();
+    }
+  }
+}
+
+/*
+ * log_free stops tracking a block. With TRACK_FREED the free call stack is
+ * captured here, once the block is found to be known, so that it takes a
+ * single lookup. It is inlined into the event handler for that reason.
+ */
+template <bool TRACK_FREED>
+static inline __attribute__((always_inline)) void log_free(void* ptr, uint32_t callstack_id, int kind,
+                                                           size_t size)
+{
+  bool invalid_dealloc = false;
+  bool mismatched_dealloc = false;
+  hu_allocinfo_t freed_allocinfo;
+
+  {
+    hu_log_shard& shard = log_shard(ptr);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    hu_allocinfo_t allocinfo;
+    if (shard.allocations.erase(ptr, &allocinfo))
+    {
+      if (TRACK_FREED)
+      {
+        callstack_id = log_capture_stack();
+      }
+
+      allocinfo_current_alloc_bytes -= log_scaled_size(allocinfo.size);
+      allocinfo_current_alloc_blocks -= log_scaled_count(allocinfo.size);
+      if (hu_log_sites)
+      {
+        hu_stack_add_live(allocinfo.callstack_id, -(long long)log_scaled_size(allocinfo.size),
+                          -(long long)log_scaled_count(allocinfo.size));
+      }
+
+      if (hu_log_sample_rate != 0)
+      {
+        log_sample_filter_count(ptr) -= 1;
+      }
+
+      if (TRACK_FREED)
+      {
+        /* Sized deallocation must also match the allocated size */
+        if (hu_log_free && ((allocinfo.kind != kind) || ((size != 0) && (size != allocinfo.size))))
+        {
+          mismatched_dealloc = true;
+          freed_allocinfo = allocinfo;
+        }
+
+        allocinfo.free_callstack_id = callstack_id;
+        log_freed_insert(shard, ptr, allocinfo);
+      }
+    }
+    else if (TRACK_FREED && hu_log_free)
+    {
+      if (log_freed_erase(shard, ptr, &freed_allocinfo))
+      {
+        invalid_dealloc = true;
+        callstack_id = log_capture_stack();
+      }
+    }
+  }
+
+  if (invalid_dealloc)
+  {
+    std::lock_guard<std::mutex> lock(*log_report_mutex);
+    log_report_wait();
+    if (log_is_valid_stack(callstack_id, false))
+    {
+      total_invalid_dealloc_count++;
+      bool is_new = reported_invalid_dealloc_callstacks->insert(callstack_id).second;
+      if (is_new || hu_log_repeat)
+      {
+        if (hu_writer_is_open())
+        {
+          hu_writer_printf("%sInvalid deallocation at:\n", hu_prefix);
+
+          log_print_stack(callstack_id);
+
+          hu_writer_printf("%s Address %p is a block of size %ld free'd at:\n",
+                  hu_prefix, ptr, freed_allocinfo.size);
+
+          log_print_stack(freed_allocinfo.free_callstack_id);
+
+          hu_writer_printf("%s Block was alloc'd at:\n", hu_prefix);
+
+          log_print_stack(freed_allocinfo.callstack_id);
+
+          hu_writer_printf("%s\n", hu_prefix);
+
+          hu_writer_flush();
+        }
+      }
+    }
+  }
+
+  if (mismatched_dealloc)
+  {
+    log_mismatched_dealloc(ptr, callstack_id, kind, size, freed_allocinfo);
+  }
+
+  allocinfo_total_frees += 1;
+}
+
+static const char* log_alloc_name(int kind)
+{
+  switch (kind)
+  {
+    case LOG_ALLOC_NEW: return "operator new";
+    case LOG_ALLOC_NEW_ARRAY: return "operator new[]";
+    default: return "malloc()";
+  }
+}
 
-  /* Group results by callstack */
-  std::map<std::vector<void*>, hu_allocinfo_t> allocations_by_callstack;
-  for (auto it = allocations->begin(); it != allocations->end(); ++it)
+static const char* log_dealloc_name(int kind)
+{
+  switch (kind)
   {
-    std::vector<void*> callstack;
-    callstack.assign(it->second.callstack, it->second.callstack + it->second.callstack_depth);
+    case LOG_ALLOC_NEW: return "operator delete";
+    case LOG_ALLOC_NEW_ARRAY: return "operator delete[]";
+    default: return "free()";
+  }
+}
+
+static void log_mismatched_dealloc(void* ptr, uint32_t callstack_id, int kind, size_t size,
+                                   const hu_allocinfo_t& allocinfo)
+{
+  std::lock_guard<std::mutex> lock(*log_report_mutex);
+  log_report_wait();
+  if (!log_is_valid_stack(callstack_id, false)) return;
 
-    auto callstack_it = allocations_by_callstack.find(callstack);
-    if (callstack_it != allocations_by_callstack.end())
+  total_mismatched_dealloc_count++;
+  bool is_new = reported_mismatched_dealloc_callstacks->insert(callstack_id).second;
+  if ((is_new || hu_log_repeat) && hu_writer_is_open())
+  {
+    if (allocinfo.kind != kind)
     {
-      callstack_it->second.count += 1;
-      callstack_it->second.size += it->second.size;
+      hu_writer_printf("%sMismatched deallocation by %s at:\n", hu_prefix, log_dealloc_name(kind));
     }
     else
     {
-      allocations_by_callstack[callstack] = it->second;
+      hu_writer_printf("%sMismatched deallocation by %s of size %zu at:\n", hu_prefix,
+                       log_dealloc_name(kind), size);
     }
 
-    leak_total_bytes += it->second.size;
-    leak_total_blocks += 1;
+    log_print_stack(callstack_id);
+
+    hu_writer_printf("%s Address %p is a block of size %zu alloc'd by %s at:\n",
+                     hu_prefix, ptr, allocinfo.size, log_alloc_name(allocinfo.kind));
+
+    log_print_stack(allocinfo.callstack_id);
+
+    hu_writer_printf("%s\n", hu_prefix);
+
+    hu_writer_flush();
   }
+}
 
-  /* Sort results by total allocation size */
-  std::multiset<hu_allocinfo_t, size_compare> allocations_by_size;
-  for (auto it = allocations_by_callstack.begin(); it != allocations_by_callstack.end(); ++it)
+static void log_apply_event(const hu_event_t* event)
+{
+  /* Only leak analysis is asynchronous, free'd blocks are not tracked */
+  if (event->event == EVENT_MALLOC)
+  {
+    log_malloc<false>(event->ptr, event->size, event->callstack_id, LOG_ALLOC_MALLOC);
+  }
+  else if (event->event == EVENT_FREE)
   {
-    allocations_by_size.insert(it->second);
+    log_free<false>(event->ptr, event->callstack_id, LOG_ALLOC_MALLOC, 0);
   }
+}
 
-  /* Indicate in case an on-demand report */
-  if (ondemand)
+/*
+ * log_timeline_snapshot records current heap usage and its top call sites in
+ * the timeline, unless another thread is already taking a snapshot or, when
+ * not forced, one was taken since the interval was reached.
+ */
+static void log_timeline_snapshot(bool force)
+{
+  std::unique_lock<std::mutex> timeline_lock(*log_timeline_mutex, std::try_to_lock);
+  if (!timeline_lock.owns_lock() && force)
   {
-    fprintf(f, "%sON DEMAND REPORT\n", hu_prefix);
+    timeline_lock.lock();
   }
 
-  /* Output error summary */
-  if (total_invalid_dealloc_count > 0 || total_invalid_access_count > 0)
+  if (!timeline_lock.owns_lock()) return;
+
+  const unsigned long long alloc_bytes = allocinfo_total_alloc_bytes.load();
+  const unsigned long long time_ms = hu_timeline_time_ms();
+  if (!force && (alloc_bytes < log_timeline_next_bytes.load()) && (time_ms < log_timeline_next_ms.load())) return;
+
+  if (hu_log_timeline_bytes != 0)
   {
-    fprintf(f, "%sERROR SUMMARY:\n", hu_prefix);
-    fprintf(f, "%s     deallocations: %llu unique (%llu total)\n", hu_prefix,
-            (unsigned long long)reported_invalid_dealloc_callstacks->size(),
-            total_invalid_dealloc_count);
-    fprintf(f, "%s     memory access: %llu unique (%llu total)\n", hu_prefix,
-            (unsigned long long)reported_invalid_access_callstacks->size(),
-            total_invalid_access_count);
-    fprintf(f, "%s\n", hu_prefix);
+    log_timeline_next_bytes = alloc_bytes + hu_log_timeline_bytes;
   }
 
-  /* Output heap summary */
-  fprintf(f, "%sHEAP SUMMARY:\n", hu_prefix);
-  fprintf(f, "%s    in use at exit: %llu bytes in %llu blocks\n",
-          hu_prefix, leak_total_bytes, leak_total_blocks);
-  fprintf(f, "%s  total heap usage: %llu allocs, %llu frees, %llu bytes allocated\n",
-          hu_prefix, allocinfo_total_allocs, allocinfo_total_frees, allocinfo_total_alloc_bytes);
-  fprintf(f, "%s   peak heap usage: %llu bytes allocated\n",
-          hu_prefix, allocinfo_peak_alloc_bytes);
-  fprintf(f, "%s\n", hu_prefix);
+  if (hu_log_timeline_ms != 0)
+  {
+    log_timeline_next_ms = time_ms + hu_log_timeline_ms;
+  }
 
-  /* Output leak details */
-  if (hu_leak)
+  hu_timeline_snapshot_t snapshot;
+  snapshot.time_ms = time_ms;
+  snapshot.alloc_bytes = alloc_bytes;
+  snapshot.heap_bytes = allocinfo_current_alloc_bytes.load();
+  snapshot.heap_blocks = log_block_count(allocinfo_current_alloc_blocks.load());
+
+  /* Keep the sites holding the most bytes */
+  std::vector<hu_siteinfo_t> top;
+  log_get_sites(top);
+  log_top_sites(top, hu_log_timeline_top);
+  snapshot.site_count = std::min(top.size(), hu_log_timeline_top);
+  for (size_t i = 0; i < snapshot.site_count; ++i)
+  {
+    snapshot.sites[i].callstack_id = top[i].callstack_id;
+    snapshot.sites[i].bytes = top[i].size;
+    snapshot.sites[i].blocks = top[i].count;
+  }
+
+  hu_timeline_add(snapshot);
+}
+
+/*
+ * log_peak_capture copies the live counters of all allocation sites, as the
+ * breakdown of a new peak. Counters of other threads' concurrent updates may
+ * or may not be included. Skipped if another thread is already capturing.
+ */
+static void log_peak_capture(unsigned long long current)
+{
+  std::unique_lock<std::mutex> peak_lock(*log_peak_mutex, std::try_to_lock);
+  if (!peak_lock.owns_lock() || (current <= log_peak_threshold.load())) return;
+
+  log_peak_threshold = current + (current >> LOG_PEAK_HYSTERESIS_SHIFT);
+  log_get_sites(*log_peak_sites);
+  log_peak_bytes = 0;
+  log_peak_blocks = 0;
+  for (const hu_siteinfo_t& site : *log_peak_sites)
+  {
+    log_peak_bytes += site.size;
+    log_peak_blocks += site.count;
+  }
+}
+
+static void log_ignore_event(int /*event*/, void* /*ptr*/, size_t /*size*/)
+{
+}
+
+static inline void log_count_event(int event, size_t size)
+{
+  if (log_is_free_event(event))
+  {
+    allocinfo_total_frees += 1;
+  }
+  else
+  {
+    allocinfo_total_allocs += 1;
+    allocinfo_total_alloc_bytes += size;
+  }
+}
+
+/*
+ * log_handle_event handles an allocation event for a given configuration:
+ * with tracing (TRACE), with guarded sampling only tracking blocks in the
+ * guarded pool (GUARD), and tracking per MODE. It is called by the allocator
+ * wrappers through log_event(), and unwinds the call stack itself, so that
+ * the wrapper is the first frame above it.
+ */
+template <bool TRACE, bool GUARD, int MODE>
+static void log_handle_event(int event, void* ptr, size_t size)
+{
+  /*
+   * Trace records all events, with call stacks of blocks of at least minimum
+   * size. The allocation call stack is then reused for tracking below.
+   */
+  uint32_t trace_callstack_id = HU_STACK_ID_NONE;
+  if (TRACE)
   {
-    for (auto it = allocations_by_size.rbegin(); (it != allocations_by_size.rend()) && (it->size >= hu_log_minleak);
-         ++it)
+    void* callstack[MAX_CALL_STACK];
+    int callstack_depth = 0;
+    if (!log_is_free_event(event) && (size >= hu_log_minleak))
     {
-      if (log_is_valid_callstack(it->callstack_depth, it->callstack, true))
-      {
-        fprintf(f, "%s%zu bytes in %d block(s) are lost, originally allocated at:\n", hu_prefix, it->size, it->count);
+      callstack_depth = hu_unwind(callstack, MAX_CALL_STACK);
+    }
+
+    /* C++ operators are recorded as their C library counterparts */
+    const int trace_event = log_is_free_event(event) ? EVENT_FREE :
+      ((event == EVENT_NEW) || (event == EVENT_NEW_ARRAY)) ? EVENT_MALLOC : event;
+    trace_callstack_id = hu_stack_intern(callstack, callstack_depth);
+    hu_trace_event(trace_event, ptr, size, trace_callstack_id);
+  }
+
+  if (MODE == LOG_MODE_COUNT)
+  {
+    log_count_event(event, size);
+    return;
+  }
 
-        log_print_callstack(f, it->callstack_depth, it->callstack);
+  if (GUARD && hu_malloc_is_unsampled(ptr))
+  {
+    log_count_event(event, size);
+    return;
+  }
+
+  if (!log_is_free_event(event))
+  {
+    if (MODE == LOG_MODE_SAMPLE)
+    {
+      /* Totals are counted exactly, as for leak mode, while only sampled blocks are tracked */
+      if (size < hu_log_minleak) return;
+
+      log_count_event(event, size);
+      if (!log_sample(size)) return;
+    }
+    else if (size < hu_log_minleak)
+    {
+      /* Untracked allocation, only needs handling if it reuses a free'd block */
+      if (MODE != LOG_MODE_ERROR) return;
+    }
 
-        fprintf(f, "%s\n", hu_prefix);
+    uint32_t callstack_id = trace_callstack_id;
+    if (!TRACE)
+    {
+      void* callstack[MAX_CALL_STACK];
+      int callstack_depth = 0;
+      if (size >= hu_log_minleak)
+      {
+        callstack_depth = hu_unwind(callstack, MAX_CALL_STACK);
       }
+
+      callstack_id = hu_stack_intern(callstack, callstack_depth);
+    }
+
+    if (MODE == LOG_MODE_LEAK_ASYNC)
+    {
+      hu_event_push(EVENT_MALLOC, ptr, size, callstack_id);
+    }
+    else
+    {
+      log_malloc<MODE == LOG_MODE_ERROR>(ptr, size, callstack_id, log_event_kind(event));
     }
   }
+  else
+  {
+    if ((MODE == LOG_MODE_SAMPLE) && (log_sample_filter_count(ptr).load(std::memory_order_relaxed) == 0))
+    {
+      /* Not a sampled block */
+      allocinfo_total_frees += 1;
+      return;
+    }
 
-  /* Output leak summary */
-  fprintf(f, "%sLEAK SUMMARY:\n", hu_prefix);
-  fprintf(f, "%s   definitely lost: %llu bytes in %llu blocks\n", hu_prefix,
-          leak_total_bytes, leak_total_blocks);
-  fprintf(f, "%s\n", hu_prefix);
+    /* Free callstack is used either as free site of a tracked block or as
+     * location of an invalid deallocation. It is only captured for known
+     * blocks, by log_free() once found, as untracked ones are also free'd
+     * during libc teardown, when backtrace() may no longer be usable. Leak
+     * analysis does not use it. */
+    const uint32_t callstack_id = HU_STACK_ID_NONE;
 
-  if (hu_useafterfree && hu_quarantine_was_evicted())
-  {
-    fprintf(f, "%sWARNING: use-after-free tracking incomplete, quarantine memory limit exceeded\n", hu_prefix);
-    fprintf(f, "%s\n", hu_prefix);
+    if (MODE == LOG_MODE_LEAK_ASYNC)
+    {
+      hu_event_push(EVENT_FREE, ptr, size, callstack_id);
+    }
+    else
+    {
+      log_free<MODE == LOG_MODE_ERROR>(ptr, callstack_id, log_event_kind(event), size);
+    }
   }
+}
 
-  fclose(f);
+template <bool TRACE, bool GUARD>
+static log_event_handler_t log_mode_handler(int mode)
+{
+  switch (mode)
+  {
+    case LOG_MODE_COUNT: return log_handle_event<TRACE, GUARD, LOG_MODE_COUNT>;
+    case LOG_MODE_LEAK: return log_handle_event<TRACE, GUARD, LOG_MODE_LEAK>;
+    case LOG_MODE_LEAK_ASYNC: return log_handle_event<TRACE, GUARD, LOG_MODE_LEAK_ASYNC>;
+    case LOG_MODE_SAMPLE: return log_handle_event<TRACE, GUARD, LOG_MODE_SAMPLE>;
+    default: return log_handle_event<TRACE, GUARD, LOG_MODE_ERROR>;
+  }
 }
 
-void hu_log_remove_freed_allocation(void* ptr)
+/* Select event handler for enabled tools, once humalloc is initialized */
+static log_event_handler_t log_select_handler()
 {
-  if (!hu_log_free)
+  int mode = LOG_MODE_LEAK;
+  if (hu_log_trace_only)
+  {
+    mode = LOG_MODE_COUNT;
+  }
+  else if (hu_useafterfree || hu_log_free)
+  {
+    mode = LOG_MODE_ERROR;
+  }
+  else if (hu_log_sample_rate != 0)
+  {
+    mode = LOG_MODE_SAMPLE;
+  }
+  else if (hu_log_async)
+  {
+    mode = LOG_MODE_LEAK_ASYNC;
+  }
+
+  const bool trace = (hu_log_trace_file != nullptr);
+  const bool guard = hu_malloc_is_guarded();
+  if (trace)
   {
-    freed_allocations->erase(ptr);
+    return guard ? log_mode_handler<true, true>(mode) : log_mode_handler<true, false>(mode);
   }
+
+  return guard ? log_mode_handler<false, true>(mode) : log_mode_handler<false, false>(mode);
 }
 
+/*
+ * Symbols are cached by address. When resolved from debug info they are also
+ * cached by object file and offset within it, and resolution uses a single
+ * long-lived resolver, which keeps debug info of each object file loaded
+ * across calls. Caller must hold log_report_mutex.
+ */
+#if LOG_HAS_RESOLVER
+#define LOG_MODULE_OFFSET_BITS 40
 
-/* ----------- Local Functions ----------------------------------- */
-static std::string addr_to_symbol(void* addr)
+static uint64_t log_module_id(const char* path)
 {
-  std::string symbol;
-  auto it = symbol_cache->find(addr);
-  if (it != symbol_cache->end())
+  auto it = module_ids->find(path);
+  if (it == module_ids->end())
   {
-    symbol = it->second;
+    it = module_ids->insert(std::make_pair(std::string(path), (uint64_t)module_ids->size() + 1)).first;
   }
-  else
+
+  return it->second;
+}
+
+static uint64_t log_symbol_key(uint64_t module_id, uintptr_t offset)
+{
+  return (module_id << LOG_MODULE_OFFSET_BITS) | (offset & ((1ULL << LOG_MODULE_OFFSET_BITS) - 1));
+}
+
+/*
+ * Returns cache keys of addresses, identifying object file and offset within
+ * it. Addresses outside any object file get module id zero. On Linux loaded
+ * objects are enumerated once per call, rather than using dladdr(), which
+ * scans the symbol table of the object for each address.
+ */
+static std::vector<uint64_t> addrs_to_symbol_keys(const std::vector<void*>& addrs)
+{
+  std::vector<uint64_t> keys;
+  keys.reserve(addrs.size());
+
+#if !defined(__APPLE__)
+  std::vector<log_module> modules = log_get_modules();
+  for (void* addr : addrs)
   {
-#if (BACKWARD_HAS_BFD == 1) || (BACKWARD_HAS_DW == 1) || (BACKWARD_HAS_DWARF == 1)
-    backward::TraceResolver trace_resolver;
-    trace_resolver.load_addresses(&addr, 1);
-    backward::Trace trace(addr, 0);
-    backward::ResolvedTrace rtrace = trace_resolver.resolve(trace);
-    if (!rtrace.source.filename.empty())
+    auto it = std::upper_bound(modules.begin(), modules.end(), (uintptr_t)addr,
+                               [](uintptr_t value, const log_module& module) { return value < module.start; });
+    if ((it != modules.begin()) && ((uintptr_t)addr < (it - 1)->end))
     {
-      const std::string& path = rtrace.source.filename;
-      std::string filename = path.substr(path.find_last_of("/\\") + 1);
-      symbol = rtrace.object_function +
-        " (" + filename + ":" + std::to_string(rtrace.source.line) + ")";
+      --it;
+      keys.push_back(log_symbol_key(log_module_id(it->path.c_str()), (uintptr_t)addr - it->base));
     }
     else
     {
-      symbol = rtrace.object_function;
+      keys.push_back(log_symbol_key(0, (uintptr_t)addr));
     }
+  }
 #else
+  for (void* addr : addrs)
+  {
     Dl_info dlinfo;
-    if (dladdr(addr, &dlinfo) && (dlinfo.dli_sname != nullptr))
+    if (dladdr(addr, &dlinfo) && (dlinfo.dli_fname != nullptr))
+    {
+      keys.push_back(log_symbol_key(log_module_id(dlinfo.dli_fname), (uintptr_t)addr - (uintptr_t)dlinfo.dli_fbase));
+    }
+    else
     {
-      if (dlinfo.dli_sname[0] == '_')
+      keys.push_back(log_symbol_key(0, (uintptr_t)addr));
+    }
+  }
+#endif
+
+  return keys;
+}
+#endif
+
+/*
+ * addr_resolve_symbol resolves an address, which when using the resolver
+ * must have been loaded at index idx of the last load_addresses() batch.
+ */
+static std::string addr_resolve_symbol(void* addr, size_t idx)
+{
+  std::string symbol;
+#if LOG_HAS_RESOLVER
+  backward::Trace trace(addr, idx);
+  backward::ResolvedTrace rtrace = trace_resolver->resolve(trace);
+  if (!rtrace.source.filename.empty())
+  {
+    const std::string& path = rtrace.source.filename;
+    std::string filename = path.substr(path.find_last_of("/\\") + 1);
+    symbol = rtrace.object_function +
+      " (" + filename + ":" + std::to_string(rtrace.source.line) + ")";
+  }
+  else
+  {
+    symbol = rtrace.object_function;
+  }
+#else
+  (void)idx;
+  Dl_info dlinfo;
+  if (dladdr(addr, &dlinfo) && (dlinfo.dli_sname != nullptr))
+  {
+    if (dlinfo.dli_sname[0] == '_')
+    {
+      int status = -1;
+      char* demangled = nullptr;
+      demangled = abi::__cxa_demangle(dlinfo.dli_sname, nullptr, 0, &status);
+      if (demangled != nullptr)
       {
-        int status = -1;
-        char* demangled = nullptr;
-        demangled = abi::__cxa_demangle(dlinfo.dli_sname, nullptr, 0, &status);
-        if (demangled != nullptr)
+        if (status == 0)
         {
-          if (status == 0)
-          {
-            symbol = std::string(demangled);
-          }
-          free(demangled);
+          symbol = std::string(demangled);
         }
+        free(demangled);
       }
+    }
 
-      if (symbol.empty())
-      {
-        symbol = std::string(dlinfo.dli_sname);
-      }
+    if (symbol.empty())
+    {
+      symbol = std::string(dlinfo.dli_sname);
+    }
 
-      if (!symbol.empty())
-      {
-        symbol += std::string(" + ");
-        symbol += std::string(std::to_string((char*)addr - (char*)dlinfo.dli_saddr));
-      }
+    if (!symbol.empty())
+    {
+      symbol += std::string(" + ");
+      symbol += std::string(std::to_string((char*)addr - (char*)dlinfo.dli_saddr));
+    }
+  }
+#endif
+
+  return symbol;
+}
+
+static void log_resolve_symbols(const std::vector<void*>& addrs)
+{
+  std::vector<void*> uncached;
+  for (void* addr : addrs)
+  {
+    if (symbol_cache->find(addr) == symbol_cache->end())
+    {
+      uncached.push_back(addr);
+    }
+  }
+
+  if (uncached.empty() || log_in_report_child) return;
+
+#if LOG_HAS_RESOLVER
+  /* Resolve in object file and offset order, each unique location once */
+  std::vector<uint64_t> keys = addrs_to_symbol_keys(uncached);
+  std::vector<std::pair<uint64_t, void*>> locations;
+  locations.reserve(uncached.size());
+  for (size_t i = 0; i < uncached.size(); ++i)
+  {
+    locations.push_back(std::make_pair(keys[i], uncached[i]));
+  }
+
+  std::sort(locations.begin(), locations.end());
+  std::vector<void*> batch;
+  std::vector<uint64_t> batch_keys;
+  for (const std::pair<uint64_t, void*>& location : locations)
+  {
+    if ((module_symbol_cache->find(location.first) == module_symbol_cache->end()) &&
+        (batch_keys.empty() || (batch_keys.back() != location.first)))
+    {
+      batch.push_back(location.second);
+      batch_keys.push_back(location.first);
     }
+  }
+
+  trace_resolver->load_addresses(batch.data(), (int)batch.size());
+  for (size_t i = 0; i < batch.size(); ++i)
+  {
+    (*module_symbol_cache)[batch_keys[i]] = addr_resolve_symbol(batch[i], i);
+  }
+
+  for (const std::pair<uint64_t, void*>& location : locations)
+  {
+    (*symbol_cache)[location.second] = (*module_symbol_cache)[location.first];
+  }
+#else
+  for (void* addr : uncached)
+  {
+    (*symbol_cache)[addr] = addr_resolve_symbol(addr, 0);
+  }
 #endif
+}
 
-    (*symbol_cache)[addr] = symbol;
+static std::string addr_to_symbol(void* addr)
+{
+  auto it = symbol_cache->find(addr);
+  if (it == symbol_cache->end())
+  {
+    log_resolve_symbols(std::vector<void*>(1, addr));
+    it = symbol_cache->find(addr);
   }
 
-  return symbol;
+  return (it != symbol_cache->end()) ? it->second : std::string();
 }
@@ -11,20 +11,79 @@
 #pragma once
 
 /* ----------- Includes ------------------------------------------ */
+#include <cstddef>
+
 #include <signal.h>
 
 
 /* ----------- Defines ------------------------------------------- */
 #define EVENT_MALLOC 1
 #define EVENT_FREE 2
+#define EVENT_CALLOC 3    /* Allocation by calloc(), only distinguished in traces */
+#define EVENT_REALLOC 4   /* Allocation by realloc(), following free of old block */
+#define EVENT_NEW 5            /* Allocation by operator new */
+#define EVENT_NEW_ARRAY 6      /* Allocation by operator new[] */
+#define EVENT_DELETE 7         /* Free by operator delete, with size if sized */
+#define EVENT_DELETE_ARRAY 8   /* Free by operator delete[], with size if sized */
+
+/* Can be externally overridden. */
+#if !defined(MAX_CALL_STACK)
+#define MAX_CALL_STACK 20   /* Limits the callstack depth to store */
+#endif
+
+
+/* ----------- Types --------------------------------------------- */
+typedef void (*log_event_handler_t)(int event, void* ptr, size_t size);
+
+struct hu_log_config
+{
+  const char* file = nullptr;
+  bool doublefree = false;
+  bool nosyms = false;
+  size_t minsize = 0;
+  bool useafterfree = false;
+  bool leak = false;
+  const char* command = nullptr;
+  bool log_pid_prefix = false;
+  bool log_repeat = false;
+  size_t shards = 64;                    /* Tracking shards, power of two */
+  bool async = false;                    /* Apply events on collector thread */
+  size_t sample_rate = 0;                /* Sampling interval bytes, zero if all tracked */
+  const char* trace_file = nullptr;      /* Binary trace output, if tracing */
+  bool trace_only = false;               /* Trace without tracking blocks */
+  size_t free_history = 0;               /* Free'd blocks kept for double-free detection */
+  size_t free_history_bytes = 0;         /* Bytes of free'd blocks kept, zero if unbounded */
+  const char* timeline_file = nullptr;   /* Timeline output, if recording timeline */
+  size_t timeline_bytes = 0;             /* Snapshot interval in bytes allocated */
+  size_t timeline_ms = 0;                /* Snapshot interval in ms */
+  size_t timeline_snapshots = 0;         /* Snapshots kept */
+  size_t timeline_top = 0;               /* Sites per snapshot */
+  size_t leak_sites = 0;                 /* Leak sites output, zero if unlimited */
+  bool peak = false;                     /* Report sites in use at peak */
+  bool report_fork = false;              /* Write on-demand reports from forked child */
+};
+
+
+/* ----------- Global Variables ---------------------------------- */
+extern log_event_handler_t log_event_handler;
 
 
 /* ----------- Global Function Prototypes ------------------------ */
-void log_init(char* file, bool doublefree, bool nosyms, size_t minsize, bool useafterfree,
-              bool leak, const char* command, bool log_pid_prefix, bool log_repeat);
+void log_init(const hu_log_config& config);
 void log_enable(int flag);
-void log_event(int event, void* ptr, size_t size);
 void log_invalid_access(void* ptr);
 void hu_sig_handler(int sig, siginfo_t* si, void* /*ucontext*/);
 void log_summary(bool ondemand);
 void hu_log_remove_freed_allocation(void* ptr);
+
+
+/* ----------- Global Inline Functions --------------------------- */
+/*
+ * log_event passes an allocation event to the handler for the enabled tools,
+ * set by log_enable(). Always inlined, as the handler unwinds the call stack
+ * assuming it is called directly from the allocator wrapper.
+ */
+static inline __attribute__((always_inline)) void log_event(int event, void* ptr, size_t size)
+{
+  log_event_handler(event, ptr, size);
+}
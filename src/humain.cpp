@@ -9,16 +9,26 @@
  */
 
 /* ----------- Includes ------------------------------------------ */
+#include <algorithm>
 #include <atomic>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
-#include <mutex>
 
+#include <new>
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <limits.h>
 #include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
 #include <stdlib.h>
 
+#include <sys/mman.h>
+
 #if defined(__APPLE__)
 #include <malloc/malloc.h>
 #endif
@@ -26,6 +36,12 @@
 #include "hulog.h"
 #include "humain.h"
 #include "humalloc.h"
+#include "huunwind.h"
+
+
+/* ----------- Defines ------------------------------------------- */
+#define HU_REPORT_POLL_NS 1000000          /* Signal handler poll interval for on-demand report */
+#define HU_REPORT_WAIT_POLLS 2000          /* Polls before resuming without on-demand report */
 
 
 /* ----------- File Global Variables ----------------------------- */
@@ -39,16 +55,22 @@ static char hu_file[PATH_MAX];
 static size_t hu_minsize = 0;
 static bool hu_nosyms = false;
 static int hu_log_signo = 0;
+static size_t hu_shards = 64;
 
 /* State */
 static bool hu_enable_humalloc = false;
+static pid_t hu_report_pid = 0;
+static pthread_t hu_reporter_thread;
+static bool hu_reporter_started = false;
+static int hu_reporter_pipe[2] = { -1, -1 };
+static std::atomic<unsigned> hu_report_requests(0);
+static std::atomic<unsigned> hu_report_served(0);
+static std::atomic<bool> hu_reporter_stopping(false);
 static thread_local bool hu_bypass = false;
 static thread_local bool hu_bypass_saved = false;
 
 /* Recursion detection (thread-local, no lock needed) */
 static thread_local int hu_callcount = 0;
-/* Mutex protecting shared data structures (non-recursive) */
-static std::mutex* hu_mutex = nullptr;
 
 #if defined(__GLIBC__)
 extern "C" void __libc_freeres();
@@ -62,15 +84,18 @@ namespace __gnu_cxx
 /* ----------- Global Functions ---------------------------------- */
 extern "C" void hu_report()
 {
+  /* Only bypass this thread, so that other threads' events are still tracked */
   hu_set_bypass(true);
-  log_enable(0);
   log_summary(true /* ondemand */);
-  log_enable(1);
   hu_set_bypass(false);
 }
 
 
 /* ----------- Local Functions ----------------------------------- */
+#if defined(__linux__)
+static inline size_t hu_sys_malloc_usable_size(void* ptr);
+#endif
+
 /*
  * hu_recursion_guard uses a thread-local call counter to detect recursion
  * (e.g. malloc called from inside log_event's std::map operations).
@@ -84,17 +109,6 @@ public:
   bool is_recursive_call() { return (hu_callcount > 1); }
 };
 
-/*
- * hu_lock_guard is a null-safe scoped mutex lock. Before hu_init runs,
- * hu_mutex is nullptr and locking is skipped.
- */
-class hu_lock_guard
-{
-public:
-  hu_lock_guard() { if (hu_mutex != nullptr) hu_mutex->lock(); }
-  ~hu_lock_guard() { if (hu_mutex != nullptr) hu_mutex->unlock(); }
-};
-
 static inline bool hu_get_env_bool(const char* name)
 {
   char* value = getenv(name);
@@ -103,12 +117,28 @@ static inline bool hu_get_env_bool(const char* name)
   return (strcmp(value, "1") == 0);
 }
 
+static inline size_t hu_get_env_shards(const char* name, size_t default_shards)
+{
+  char* value = getenv(name);
+  if ((value == nullptr) || !value[0]) return default_shards;
+
+  /* Round up to power of two, limited to a sane range */
+  long long requested = strtoll(value, nullptr, 10);
+  size_t shards = 1;
+  while ((shards < (size_t)requested) && (shards < 4096))
+  {
+    shards <<= 1;
+  }
+
+  return shards;
+}
+
 static void hu_atfork_prepare()
 {
   /*
    * Set bypass on the forking thread only (hu_bypass is thread-local) so
-   * its allocation wrappers pass through without touching the mutex during
-   * fork. Other threads are unaffected and continue handling hu_malloc'd
+   * its allocation wrappers pass through without touching the shard locks
+   * during fork. Other threads are unaffected and continue handling hu_malloc'd
    * pointers correctly — a global bypass would cause them to pass offset
    * pointers to the system allocator, crashing in realloc/free.
    */
@@ -126,9 +156,122 @@ static void hu_atfork_child()
   /* Keep hu_bypass = true - child should not track allocations */
 }
 
-void signal_handler(int)
+/*
+ * hu_reporter writes on-demand reports requested with signal hu_log_signo,
+ * so that no report is generated in signal context. The signal handler only
+ * numbers the request and wakes the reporter through a pipe, which leaves the
+ * signal mask of application threads, and of programs they start, as is.
+ * Requests arriving while a report is written are served by a single report.
+ */
+static void hu_reporter_serve()
 {
+  const unsigned requested = hu_report_requests.load();
+  if (requested == hu_report_served.load()) return;
+
   hu_report();
+  hu_report_served.store(requested);
+}
+
+static void* hu_reporter(void*)
+{
+  while (true)
+  {
+    char byte = 0;
+    ssize_t rv = read(hu_reporter_pipe[0], &byte, 1);
+    if ((rv == -1) && (errno == EINTR)) continue;
+
+    hu_reporter_serve();
+    if (hu_reporter_stopping || (rv != 1)) break;
+  }
+
+  return nullptr;
+}
+
+static bool hu_reporter_init()
+{
+  hu_report_pid = getpid();
+  if (pipe(hu_reporter_pipe) != 0)
+  {
+    fprintf(stderr, "heapusage error: unable to create reporter pipe, errno %d\n", errno);
+    return false;
+  }
+
+  /* Not inherited by exec'd programs, and a full pipe already has a wakeup pending */
+  fcntl(hu_reporter_pipe[0], F_SETFD, FD_CLOEXEC);
+  fcntl(hu_reporter_pipe[1], F_SETFD, FD_CLOEXEC);
+  fcntl(hu_reporter_pipe[1], F_SETFL, fcntl(hu_reporter_pipe[1], F_GETFL) | O_NONBLOCK);
+
+  /* Start reporter with all signals blocked, so that it is never interrupted */
+  sigset_t all_signals;
+  sigset_t old_signals;
+  sigfillset(&all_signals);
+  pthread_sigmask(SIG_SETMASK, &all_signals, &old_signals);
+  int rv = pthread_create(&hu_reporter_thread, nullptr, hu_reporter, nullptr);
+  pthread_sigmask(SIG_SETMASK, &old_signals, nullptr);
+  if (rv != 0)
+  {
+    fprintf(stderr, "heapusage error: unable to start reporter thread, errno %d\n", rv);
+    close(hu_reporter_pipe[0]);
+    close(hu_reporter_pipe[1]);
+    return false;
+  }
+
+  hu_reporter_started = true;
+  return true;
+}
+
+/*
+ * hu_reporter_stop waits for a report being written, and writes one still
+ * requested, before the report at exit.
+ */
+static void hu_reporter_stop()
+{
+  if (!hu_reporter_started || (getpid() != hu_report_pid)) return;
+
+  hu_reporter_stopping = true;
+  const char byte = 0;
+  while ((write(hu_reporter_pipe[1], &byte, 1) == -1) && (errno == EINTR))
+  {
+  }
+
+  pthread_join(hu_reporter_thread, nullptr);
+  hu_reporter_started = false;
+
+  /* Requested after the reporter checked for the last time */
+  hu_reporter_serve();
+}
+
+void signal_handler(int /*sig*/)
+{
+  /* Only async-signal-safe calls may be made here */
+  const int saved_errno = errno;
+  if (getpid() != hu_report_pid)
+  {
+    /* A forked child is not tracked, so it has no reporter */
+    static const char msg[] = "heapusage: on-demand reports are not supported in forked child processes\n";
+    ssize_t rv = write(STDERR_FILENO, msg, sizeof(msg) - 1);
+    (void)rv;
+  }
+  else if (!hu_reporter_stopping)
+  {
+    const unsigned request = hu_report_requests.fetch_add(1) + 1;
+    const char byte = 0;
+    ssize_t rv = write(hu_reporter_pipe[1], &byte, 1);
+    (void)rv;
+
+    /*
+     * Hold the interrupted thread until the report is written, so it reflects
+     * the state when signalled. The wait is bounded, as the report cannot
+     * progress if this thread was interrupted holding a lock it needs.
+     */
+    struct timespec interval = { 0, HU_REPORT_POLL_NS };
+    for (int i = 0; (i < HU_REPORT_WAIT_POLLS) && ((int)(hu_report_served.load() - request) < 0); ++i)
+    {
+      nanosleep(&interval, nullptr);
+    }
+  }
+
+  errno = saved_errno;
 }
 
 
@@ -156,35 +299,154 @@ void __attribute__ ((constructor)) hu_init(void)
 
   hu_minsize = (getenv("HU_MINSIZE") != nullptr) ? strtoll(getenv("HU_MINSIZE"), nullptr, 10) : 0;
   hu_nosyms = hu_get_env_bool("HU_NOSYMS");
+  hu_shards = hu_get_env_shards("HU_SHARDS", hu_shards);
+
+  /* Init unwinder */
+  const char* unwind_env = getenv("HU_UNWIND");
+  hu_unwind_init((unwind_env != nullptr) && (strcmp(unwind_env, "fp") == 0));
 
   /* Init logging */
-  const char* hu_command = getenv("HU_COMMAND");
-  bool hu_log_pid_prefix = hu_get_env_bool("HU_LOGPID");
-  bool hu_log_repeat = hu_get_env_bool("HU_REPEAT");
-  log_init(hu_file, hu_doublefree, hu_nosyms, hu_minsize, hu_useafterfree, hu_leak,
-           hu_command, hu_log_pid_prefix, hu_log_repeat);
+  hu_log_config log_config;
+  log_config.file = hu_file;
+  log_config.doublefree = hu_doublefree;
+  log_config.nosyms = hu_nosyms;
+  log_config.minsize = hu_minsize;
+  log_config.useafterfree = hu_useafterfree;
+  log_config.leak = hu_leak;
+  log_config.command = getenv("HU_COMMAND");
+  log_config.log_pid_prefix = hu_get_env_bool("HU_LOGPID");
+  log_config.log_repeat = hu_get_env_bool("HU_REPEAT");
+  log_config.shards = hu_shards;
 
-  /* Init mutex for shared data protection */
-  hu_bypass = true;
-  hu_mutex = new std::mutex();
-  hu_bypass = false;
+  /*
+   * Sampling tracks only a random subset of allocations, chosen by average
+   * byte interval HU_SAMPLE_RATE, and is only used with leak-only analysis
+   * as error detection needs every block tracked. As tracked blocks are few,
+   * events are then applied synchronously.
+   */
+  if (hu_get_env_bool("HU_SAMPLE") && !hu_doublefree && !hu_overflow && !hu_useafterfree)
+  {
+    const char* sample_rate_env = getenv("HU_SAMPLE_RATE");
+    log_config.sample_rate = ((sample_rate_env != nullptr) && sample_rate_env[0]) ?
+      strtoull(sample_rate_env, nullptr, 10) : (512 * 1024);
+  }
+
+  /*
+   * Timeline snapshots of heap usage and its top HU_TIMELINE_TOP call sites
+   * are taken every HU_TIMELINE_BYTES bytes allocated or HU_TIMELINE_MS
+   * milliseconds, and written to HU_TIMELINE_FILE at exit. At most
+   * HU_TIMELINE_SNAPSHOTS are kept, older ones being coalesced.
+   */
+  if (hu_get_env_bool("HU_TIMELINE"))
+  {
+    const char* timeline_file_env = getenv("HU_TIMELINE_FILE");
+    log_config.timeline_file = ((timeline_file_env != nullptr) && timeline_file_env[0]) ?
+      timeline_file_env : "heapusage.timeline";
+    const char* timeline_bytes_env = getenv("HU_TIMELINE_BYTES");
+    log_config.timeline_bytes = ((timeline_bytes_env != nullptr) && timeline_bytes_env[0]) ?
+      strtoull(timeline_bytes_env, nullptr, 10) : (1024 * 1024);
+    const char* timeline_ms_env = getenv("HU_TIMELINE_MS");
+    log_config.timeline_ms = ((timeline_ms_env != nullptr) && timeline_ms_env[0]) ?
+      strtoull(timeline_ms_env, nullptr, 10) : 1000;
+    const char* timeline_snapshots_env = getenv("HU_TIMELINE_SNAPSHOTS");
+    log_config.timeline_snapshots = ((timeline_snapshots_env != nullptr) && timeline_snapshots_env[0]) ?
+      strtoull(timeline_snapshots_env, nullptr, 10) : 200;
+    const char* timeline_top_env = getenv("HU_TIMELINE_TOP");
+    log_config.timeline_top = ((timeline_top_env != nullptr) && timeline_top_env[0]) ?
+      strtoull(timeline_top_env, nullptr, 10) : 10;
+  }
+
+  /*
+   * Tracing writes all events to a binary file HU_TRACE_FILE for offline
+   * analysis. Used alone, no blocks are tracked in-process.
+   */
+  if (hu_get_env_bool("HU_TRACE"))
+  {
+    const char* trace_file_env = getenv("HU_TRACE_FILE");
+    log_config.trace_file = ((trace_file_env != nullptr) && trace_file_env[0]) ? trace_file_env : "heapusage.trace";
+    log_config.trace_only = !hu_doublefree && !hu_leak && !hu_overflow && !hu_useafterfree &&
+      (log_config.timeline_file == nullptr);
+  }
+
+  /*
+   * Double-free detection keeps free'd blocks in a history bounded to the
+   * most recent HU_FREE_HISTORY frees, and optionally to HU_FREE_HISTORY_BYTES
+   * bytes of free'd blocks, whichever limit is reached first.
+   */
+  const char* free_history_env = getenv("HU_FREE_HISTORY");
+  log_config.free_history = ((free_history_env != nullptr) && free_history_env[0]) ?
+    strtoull(free_history_env, nullptr, 10) : (256 * 1024);
+  const char* free_history_bytes_env = getenv("HU_FREE_HISTORY_BYTES");
+  log_config.free_history_bytes = ((free_history_bytes_env != nullptr) && free_history_bytes_env[0]) ?
+    strtoull(free_history_bytes_env, nullptr, 10) : 0;
+
+  /* Leak report lists the HU_LEAK_SITES sites with the most bytes lost, or all of them */
+  const char* leak_sites_env = getenv("HU_LEAK_SITES");
+  log_config.leak_sites = ((leak_sites_env != nullptr) && leak_sites_env[0]) ?
+    strtoull(leak_sites_env, nullptr, 10) : 0;
+
+  /* Peak summary lists the sites holding the most memory at peak heap usage */
+  log_config.peak = hu_get_env_bool("HU_PEAK");
+
+  /* On-demand reports are written by a forked child, from a snapshot of the tracking state */
+  log_config.report_fork = hu_get_env_bool("HU_REPORT_FORK");
+
+  /*
+   * Leak-only analysis does not need tracking state to be current at each
+   * free (no double-free or invalid access reporting), so events can be
+   * buffered per thread and applied by a collector thread. Disable with
+   * HU_ASYNC=0.
+   */
+  const char* async_env = getenv("HU_ASYNC");
+  log_config.async = !hu_doublefree && !hu_overflow && !hu_useafterfree && (log_config.sample_rate == 0) &&
+    !log_config.trace_only && !((async_env != nullptr) && (strcmp(async_env, "0") == 0));
+  log_init(log_config);
 
   /* Register fork safety handlers */
   pthread_atfork(hu_atfork_prepare, hu_atfork_parent, hu_atfork_child);
 
+#if defined(__linux__)
+  /* Resolve now, as a report child must not take the dynamic loader lock */
+  hu_sys_malloc_usable_size(nullptr);
+#endif
+
   /* Init custom malloc */
   hu_enable_humalloc = (hu_overflow || hu_useafterfree);
   if (hu_enable_humalloc)
   {
+    hu_malloc_config malloc_config;
+    malloc_config.overflow = hu_overflow;
+    malloc_config.useafterfree = hu_useafterfree;
+    malloc_config.minsize = hu_minsize;
+    malloc_config.shards = hu_shards;
     const char* quarantine_env = getenv("HU_QUARANTINE");
-    int hu_quarantine_pct = ((quarantine_env != nullptr) && quarantine_env[0]) ?
+    malloc_config.quarantine_pct = ((quarantine_env != nullptr) && quarantine_env[0]) ?
       (int)strtoll(quarantine_env, nullptr, 10) : 10;
-    hu_malloc_init(hu_overflow, hu_useafterfree, hu_minsize, hu_quarantine_pct);
+    const char* quarantine_policy_env = getenv("HU_QUARANTINE_POLICY");
+    malloc_config.quarantine_largest_first =
+      (quarantine_policy_env != nullptr) && (strcmp(quarantine_policy_env, "largest") == 0);
+
+    /*
+     * Guarded sampling places only one in HU_GUARD_SAMPLE allocations in a
+     * fixed pool of HU_GUARD_SLOTS guarded slots, leaving the rest to the
+     * system allocator. Not used with leak analysis, which needs every block.
+     */
+    if (hu_get_env_bool("HU_GUARD") && !hu_leak)
+    {
+      const char* guard_sample_env = getenv("HU_GUARD_SAMPLE");
+      malloc_config.guard_sample = ((guard_sample_env != nullptr) && guard_sample_env[0]) ?
+        strtoull(guard_sample_env, nullptr, 10) : 1000;
+      const char* guard_slots_env = getenv("HU_GUARD_SLOTS");
+      malloc_config.guard_slots = ((guard_slots_env != nullptr) && guard_slots_env[0]) ?
+        strtoull(guard_slots_env, nullptr, 10) : 1024;
+    }
+
+    hu_malloc_init(malloc_config);
   }
 
   /* Register signal handler */
   hu_log_signo = (getenv("HU_SIGNO") != nullptr) ? strtoll(getenv("HU_SIGNO"), nullptr, 10) : 0;
-  if (hu_log_signo != 0)
+  if ((hu_log_signo != 0) && hu_reporter_init())
   {
     signal(hu_log_signo, signal_handler);
   }
@@ -200,6 +462,9 @@ void __attribute__ ((constructor)) hu_init(void)
 extern "C"
 void __attribute__ ((destructor)) hu_fini(void)
 {
+  /* Complete on-demand reports before the report at exit */
+  hu_reporter_stop();
+
 #if defined(__GLIBC__)
   /* Free libc resources */
   __libc_freeres();
@@ -211,17 +476,15 @@ void __attribute__ ((destructor)) hu_fini(void)
 
   /*
    * Bypass this thread's wrappers so log_summary's internal allocations
-   * use the system allocator without touching the mutex. Hold the lock
-   * during summary to prevent concurrent modification of tracking data
-   * by other threads that are still running during exit().
+   * use the system allocator without touching the shard locks. The summary
+   * itself holds all shard locks while collecting tracking data, preventing
+   * concurrent modification by other threads still running during exit().
    *
    * Leave hu_enable_humalloc true — other threads may still free
    * hu_malloc'd pointers. The OS reclaims all memory at termination.
    */
   hu_bypass = true;
-  if (hu_mutex != nullptr) hu_mutex->lock();
   log_summary(false /* ondemand */);
-  if (hu_mutex != nullptr) hu_mutex->unlock();
 
   /*
    * Restore bypass so that subsequent free() calls from other libraries'
@@ -245,16 +508,134 @@ extern "C" void* __libc_malloc(size_t size);
 extern "C" void __libc_free(void* ptr);
 extern "C" void* __libc_calloc(size_t nmemb, size_t size);
 extern "C" void* __libc_realloc(void* ptr, size_t size);
+extern "C" void* __libc_memalign(size_t alignment, size_t size);
+
+/* No glibc internal alias, resolved on first use */
+static size_t (*hu_libc_malloc_usable_size)(void* ptr) = nullptr;
+
+static inline size_t hu_sys_malloc_usable_size(void* ptr)
+{
+  if (hu_libc_malloc_usable_size == nullptr)
+  {
+    hu_libc_malloc_usable_size = (size_t (*)(void*))dlsym(RTLD_NEXT, "malloc_usable_size");
+    if (hu_libc_malloc_usable_size == nullptr) return 0;
+  }
+
+  return hu_libc_malloc_usable_size(ptr);
+}
+
+static inline bool hu_is_power_of_two(size_t value)
+{
+  return (value != 0) && ((value & (value - 1)) == 0);
+}
+
+/*
+ * Private heap of a report child. The child is created without fork()
+ * handlers, so the system allocator may have been locked by another thread
+ * at the time. Blocks are carved from a reserved mapping, each preceded by
+ * its size, and never released, as the child exits after its report.
+ */
+#define HU_PRIVATE_HEAP_MAX_SIZE ((size_t)1 << ((sizeof(void*) == 8) ? 32 : 28))   /* Address space reserved */
+#define HU_PRIVATE_HEAP_MIN_SIZE ((size_t)1 << 24)   /* Smallest reservation, if address space is limited */
+#define HU_PRIVATE_HEAP_ALIGN 16                    /* Minimum block alignment */
+
+static char* hu_private_heap = nullptr;
+static size_t hu_private_heap_size = 0;
+static size_t hu_private_heap_used = 0;
+
+static void* hu_private_alloc(size_t size, size_t alignment)
+{
+  alignment = std::max(alignment, (size_t)HU_PRIVATE_HEAP_ALIGN);
+  const size_t offset = (hu_private_heap_used + sizeof(size_t) + alignment - 1) & ~(alignment - 1);
+  if ((size > hu_private_heap_size) || ((offset + size) > hu_private_heap_size)) return nullptr;
+
+  *(size_t*)(hu_private_heap + offset - sizeof(size_t)) = size;
+  hu_private_heap_used = offset + size;
+  return hu_private_heap + offset;
+}
+
+static size_t hu_private_size(void* ptr)
+{
+  if (((char*)ptr < hu_private_heap) || ((char*)ptr >= (hu_private_heap + hu_private_heap_size)))
+  {
+    return hu_sys_malloc_usable_size(ptr);
+  }
+
+  return *(size_t*)((char*)ptr - sizeof(size_t));
+}
+
+static void* hu_private_calloc(size_t nmemb, size_t size)
+{
+  /* Never reused, so already zero-filled */
+  if ((size != 0) && (nmemb > (SIZE_MAX / size))) return nullptr;
+
+  return hu_private_alloc(nmemb * size, 0);
+}
+
+static void* hu_private_realloc(void* ptr, size_t size)
+{
+  void* newptr = hu_private_alloc(size, 0);
+  if ((newptr != nullptr) && (ptr != nullptr))
+  {
+    memcpy(newptr, ptr, std::min(size, hu_private_size(ptr)));
+  }
+
+  return newptr;
+}
+
+/*
+ * Serve this process' allocations from the private heap, in a report child.
+ * The reservation is reduced until it succeeds, e.g. if limited by
+ * RLIMIT_AS or overcommit settings.
+ */
+bool hu_use_private_heap()
+{
+  for (size_t size = HU_PRIVATE_HEAP_MAX_SIZE; size >= HU_PRIVATE_HEAP_MIN_SIZE; size /= 2)
+  {
+    void* mem = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (mem != MAP_FAILED)
+    {
+      hu_private_heap_size = size;
+      hu_private_heap = (char*)mem;
+      return true;
+    }
+  }
+
+  return false;
+}
+
+/*
+ * hu_memalign_wrap is shared by the aligned allocation wrappers, always
+ * inlined so that the wrapper is the first frame above the event handler.
+ */
+static inline __attribute__((always_inline)) void* hu_memalign_wrap(size_t alignment, size_t size)
+{
+  if (hu_bypass)
+  {
+    return (hu_private_heap != nullptr) ? hu_private_alloc(size, alignment) : __libc_memalign(alignment, size);
+  }
+
+  hu_recursion_guard guard;
+  if (guard.is_recursive_call()) return __libc_memalign(alignment, size);
+
+  void* ptr = hu_enable_humalloc ? hu_memalign(alignment, size) : __libc_memalign(alignment, size);
+  if (size > 0)
+  {
+    log_event(EVENT_MALLOC, ptr, size);
+  }
+
+  return ptr;
+}
 
 extern "C"
 void* malloc(size_t size)
 {
-  if (hu_bypass) return __libc_malloc(size);
+  if (hu_bypass) return (hu_private_heap != nullptr) ? hu_private_alloc(size, 0) : __libc_malloc(size);
 
   hu_recursion_guard guard;
   if (guard.is_recursive_call()) return __libc_malloc(size);
 
-  hu_lock_guard lock;
   void* ptr = hu_enable_humalloc ? hu_malloc(size) : __libc_malloc(size);
   if (size > 0)
   {
@@ -267,29 +648,31 @@ void* malloc(size_t size)
 extern "C"
 void free(void* ptr)
 {
-  if (hu_bypass) return __libc_free(ptr);
+  if (hu_bypass) return (hu_private_heap != nullptr) ? (void)0 : __libc_free(ptr);
 
   hu_recursion_guard guard;
   if (guard.is_recursive_call()) return __libc_free(ptr);
 
-  hu_lock_guard lock;
-  hu_enable_humalloc ? hu_free(ptr) : __libc_free(ptr);
+  /* Log before releasing, so a concurrent allocation reusing the address is logged after */
   log_event(EVENT_FREE, ptr, 0);
+  hu_enable_humalloc ? hu_free(ptr) : __libc_free(ptr);
 }
 
 extern "C"
 void* calloc(size_t nmemb, size_t size)
 {
-  if (hu_bypass) return __libc_calloc(nmemb, size);
+  if (hu_bypass)
+  {
+    return (hu_private_heap != nullptr) ? hu_private_calloc(nmemb, size) : __libc_calloc(nmemb, size);
+  }
 
   hu_recursion_guard guard;
   if (guard.is_recursive_call()) return __libc_calloc(nmemb, size);
 
-  hu_lock_guard lock;
   void* ptr = hu_enable_humalloc ? hu_calloc(nmemb, size) : __libc_calloc(nmemb, size);
   if ((nmemb > 0) && (size > 0))
   {
-    log_event(EVENT_MALLOC, ptr, nmemb * size);
+    log_event(EVENT_CALLOC, ptr, nmemb * size);
   }
 
   return ptr;
@@ -298,26 +681,84 @@ void* calloc(size_t nmemb, size_t size)
 extern "C"
 void* realloc(void* ptr, size_t size)
 {
-  if (hu_bypass) return __libc_realloc(ptr, size);
+  if (hu_bypass)
+  {
+    return (hu_private_heap != nullptr) ? hu_private_realloc(ptr, size) : __libc_realloc(ptr, size);
+  }
 
   hu_recursion_guard guard;
   if (guard.is_recursive_call()) return __libc_realloc(ptr, size);
 
-  hu_lock_guard lock;
-  void* newptr = hu_enable_humalloc ? hu_realloc(ptr, size) : __libc_realloc(ptr, size);
   if (ptr != nullptr)
   {
     log_event(EVENT_FREE, ptr, 0);
   }
 
+  void* newptr = hu_enable_humalloc ? hu_realloc(ptr, size) : __libc_realloc(ptr, size);
   if (size != 0)
   {
-    log_event(EVENT_MALLOC, newptr, size);
+    log_event(EVENT_REALLOC, newptr, size);
   }
 
   return newptr;
 }
 
+extern "C"
+void* memalign(size_t alignment, size_t size)
+{
+  return hu_memalign_wrap(alignment, size);
+}
+
+extern "C"
+int posix_memalign(void** memptr, size_t alignment, size_t size)
+{
+  if (!hu_is_power_of_two(alignment) || ((alignment % sizeof(void*)) != 0)) return EINVAL;
+
+  void* ptr = hu_memalign_wrap(alignment, size);
+  if (ptr == nullptr) return ENOMEM;
+
+  *memptr = ptr;
+  return 0;
+}
+
+extern "C"
+void* aligned_alloc(size_t alignment, size_t size)
+{
+  if (!hu_is_power_of_two(alignment))
+  {
+    errno = EINVAL;
+    return nullptr;
+  }
+
+  return hu_memalign_wrap(alignment, size);
+}
+
+extern "C"
+void* valloc(size_t size)
+{
+  return hu_memalign_wrap(getpagesize(), size);
+}
+
+extern "C"
+void* pvalloc(size_t size)
+{
+  /* Size rounded up to whole pages, at least one */
+  const size_t page_size = getpagesize();
+  const size_t rounded_size = std::max((size + page_size - 1) & ~(page_size - 1), page_size);
+  return hu_memalign_wrap(page_size, rounded_size);
+}
+
+extern "C"
+size_t malloc_usable_size(void* ptr)
+{
+  if (hu_bypass) return (hu_private_heap != nullptr) ? hu_private_size(ptr) : hu_sys_malloc_usable_size(ptr);
+
+  hu_recursion_guard guard;
+  if (guard.is_recursive_call()) return hu_sys_malloc_usable_size(ptr);
+
+  return hu_enable_humalloc ? hu_malloc_size(ptr) : hu_sys_malloc_usable_size(ptr);
+}
+
 
 #elif defined(__APPLE__)
 /* ----------- Apple Wrapper Functions --------------------------- */
@@ -341,7 +782,6 @@ void* malloc_wrap(size_t size)
   hu_recursion_guard guard;
   if (guard.is_recursive_call()) return malloc(size);
 
-  hu_lock_guard lock;
   void* ptr = hu_enable_humalloc ? hu_malloc(size) : malloc(size);
   if (size > 0)
   {
@@ -360,9 +800,8 @@ void free_wrap(void* ptr)
   hu_recursion_guard guard;
   if (guard.is_recursive_call()) return free(ptr);
 
-  hu_lock_guard lock;
-  hu_enable_humalloc ? hu_free(ptr) : free(ptr);
   log_event(EVENT_FREE, ptr, 0);
+  hu_enable_humalloc ? hu_free(ptr) : free(ptr);
 }
 DYLD_INTERPOSE(free_wrap, free);
 
@@ -374,11 +813,10 @@ void* calloc_wrap(size_t nmemb, size_t size)
   hu_recursion_guard guard;
   if (guard.is_recursive_call()) return calloc(nmemb, size);
 
-  hu_lock_guard lock;
   void* ptr = hu_enable_humalloc ? hu_calloc(nmemb, size) : calloc(nmemb, size);
   if ((nmemb > 0) && (size > 0))
   {
-    log_event(EVENT_MALLOC, ptr, nmemb * size);
+    log_event(EVENT_CALLOC, ptr, nmemb * size);
   }
 
   return ptr;
@@ -393,16 +831,15 @@ void* realloc_wrap(void* ptr, size_t size)
   hu_recursion_guard guard;
   if (guard.is_recursive_call()) return realloc(ptr, size);
 
-  hu_lock_guard lock;
-  void* newptr = hu_enable_humalloc ? hu_realloc(ptr, size) : realloc(ptr, size);
   if (ptr != nullptr)
   {
     log_event(EVENT_FREE, ptr, 0);
   }
 
+  void* newptr = hu_enable_humalloc ? hu_realloc(ptr, size) : realloc(ptr, size);
   if (size != 0)
   {
-    log_event(EVENT_MALLOC, newptr, size);
+    log_event(EVENT_REALLOC, newptr, size);
   }
 
   return newptr;
@@ -417,7 +854,6 @@ size_t malloc_size_wrap(const void* ptr)
   hu_recursion_guard guard;
   if (guard.is_recursive_call()) return malloc_size(ptr);
 
-  hu_lock_guard lock;
   return hu_enable_humalloc ? hu_malloc_size(const_cast<void*>(ptr)) : malloc_size(ptr);
 }
 DYLD_INTERPOSE(malloc_size_wrap, malloc_size);
@@ -426,3 +862,207 @@ DYLD_INTERPOSE(malloc_size_wrap, malloc_size);
 #else
 #warning "Unsupported platform"
 #endif
+
+
+#if defined(__linux__) || defined(__APPLE__)
+/* ----------- C++ Wrapper Functions ----------------------------- */
+/* System allocation, aligned if alignment is non-zero */
+static inline void* hu_sys_alloc(size_t size, size_t alignment)
+{
+#if defined(__linux__)
+  if (hu_private_heap != nullptr) return hu_private_alloc(size, alignment);
+
+  return (alignment == 0) ? __libc_malloc(size) : __libc_memalign(alignment, size);
+#else
+  if (alignment == 0) return malloc(size);
+
+  void* ptr = nullptr;
+  return (posix_memalign(&ptr, std::max(alignment, sizeof(void*)), size) == 0) ? ptr : nullptr;
+#endif
+}
+
+static inline void hu_sys_free(void* ptr)
+{
+#if defined(__linux__)
+  if (hu_private_heap != nullptr) return;
+
+  __libc_free(ptr);
+#else
+  free(ptr);
+#endif
+}
+
+/*
+ * Operators new and delete are interposed directly, rather than seen through
+ * the malloc() and free() calls made by the C++ runtime, so that call stacks
+ * start at the caller, and so that the allocating operator can be matched
+ * against the deallocating one. The helpers below are always inlined, for the
+ * operator to be the first frame above the event handler, like the C library
+ * wrappers.
+ */
+static inline __attribute__((always_inline)) void* hu_new_alloc(size_t size, size_t alignment, int event)
+{
+  if (hu_bypass) return hu_sys_alloc(size, alignment);
+
+  hu_recursion_guard guard;
+  if (guard.is_recursive_call()) return hu_sys_alloc(size, alignment);
+
+  void* ptr = !hu_enable_humalloc ? hu_sys_alloc(size, alignment) :
+    ((alignment == 0) ? hu_malloc(size) : hu_memalign(alignment, size));
+  if ((ptr != nullptr) && (size > 0))
+  {
+    log_event(event, ptr, size);
+  }
+
+  return ptr;
+}
+
+static inline __attribute__((always_inline)) void* hu_new(size_t size, size_t alignment, int event, bool nothrow)
+{
+  void* ptr = hu_new_alloc(size, alignment, event);
+  while (ptr == nullptr)
+  {
+    /* Standard behaviour on failure, call new handler until it succeeds */
+    std::new_handler handler = std::get_new_handler();
+    if (handler == nullptr)
+    {
+      if (nothrow) return nullptr;
+
+      throw std::bad_alloc();
+    }
+
+    if (nothrow)
+    {
+      try
+      {
+        handler();
+      }
+      catch (const std::bad_alloc&)
+      {
+        return nullptr;
+      }
+    }
+    else
+    {
+      handler();
+    }
+
+    ptr = hu_new_alloc(size, alignment, event);
+  }
+
+  return ptr;
+}
+
+static inline __attribute__((always_inline)) void hu_delete(void* ptr, size_t size, int event)
+{
+  if (hu_bypass) return hu_sys_free(ptr);
+
+  hu_recursion_guard guard;
+  if (guard.is_recursive_call()) return hu_sys_free(ptr);
+
+  if (ptr == nullptr) return;
+
+  log_event(event, ptr, size);
+  hu_enable_humalloc ? hu_free(ptr) : hu_sys_free(ptr);
+}
+
+void* operator new(std::size_t size)
+{
+  return hu_new(size, 0, EVENT_NEW, false);
+}
+
+void* operator new[](std::size_t size)
+{
+  return hu_new(size, 0, EVENT_NEW_ARRAY, false);
+}
+
+void* operator new(std::size_t size, const std::nothrow_t&) noexcept
+{
+  return hu_new(size, 0, EVENT_NEW, true);
+}
+
+void* operator new[](std::size_t size, const std::nothrow_t&) noexcept
+{
+  return hu_new(size, 0, EVENT_NEW_ARRAY, true);
+}
+
+void operator delete(void* ptr) noexcept
+{
+  hu_delete(ptr, 0, EVENT_DELETE);
+}
+
+void operator delete[](void* ptr) noexcept
+{
+  hu_delete(ptr, 0, EVENT_DELETE_ARRAY);
+}
+
+void operator delete(void* ptr, const std::nothrow_t&) noexcept
+{
+  hu_delete(ptr, 0, EVENT_DELETE);
+}
+
+void operator delete[](void* ptr, const std::nothrow_t&) noexcept
+{
+  hu_delete(ptr, 0, EVENT_DELETE_ARRAY);
+}
+
+void operator delete(void* ptr, std::size_t size) noexcept
+{
+  hu_delete(ptr, size, EVENT_DELETE);
+}
+
+void operator delete[](void* ptr, std::size_t size) noexcept
+{
+  hu_delete(ptr, size, EVENT_DELETE_ARRAY);
+}
+
+void* operator new(std::size_t size, std::align_val_t alignment)
+{
+  return hu_new(size, (size_t)alignment, EVENT_NEW, false);
+}
+
+void* operator new[](std::size_t size, std::align_val_t alignment)
+{
+  return hu_new(size, (size_t)alignment, EVENT_NEW_ARRAY, false);
+}
+
+void* operator new(std::size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept
+{
+  return hu_new(size, (size_t)alignment, EVENT_NEW, true);
+}
+
+void* operator new[](std::size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept
+{
+  return hu_new(size, (size_t)alignment, EVENT_NEW_ARRAY, true);
+}
+
+void operator delete(void* ptr, std::align_val_t) noexcept
+{
+  hu_delete(ptr, 0, EVENT_DELETE);
+}
+
+void operator delete[](void* ptr, std::align_val_t) noexcept
+{
+  hu_delete(ptr, 0, EVENT_DELETE_ARRAY);
+}
+
+void operator delete(void* ptr, std::align_val_t, const std::nothrow_t&) noexcept
+{
+  hu_delete(ptr, 0, EVENT_DELETE);
+}
+
+void operator delete[](void* ptr, std::align_val_t, const std::nothrow_t&) noexcept
+{
+  hu_delete(ptr, 0, EVENT_DELETE_ARRAY);
+}
+
+void operator delete(void* ptr, std::size_t size, std::align_val_t) noexcept
+{
+  hu_delete(ptr, size, EVENT_DELETE);
+}
+
+void operator delete[](void* ptr, std::size_t size, std::align_val_t) noexcept
+{
+  hu_delete(ptr, size, EVENT_DELETE_ARRAY);
+}
+#endif
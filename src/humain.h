@@ -10,8 +10,29 @@
 
 #pragma once
 
+/* ----------- Includes ------------------------------------------ */
+#include <cstddef>
+#include <cstdint>
+
+
 /* ----------- Global Function Prototypes ------------------------ */
 extern "C" void __attribute__ ((constructor)) hu_init(void);
 extern "C" void __attribute__ ((destructor)) hu_fini(void);
 
 void hu_set_bypass(bool bypass);
+#if defined(__linux__)
+bool hu_use_private_heap();
+#endif
+
+
+/* ----------- Global Inline Functions --------------------------- */
+/*
+ * hu_shard_index maps a heap pointer to one of the (power of two) tracking
+ * shards. Low bits are always zero due to allocation alignment, so the
+ * address is mixed before masking to spread neighbouring blocks evenly.
+ */
+static inline size_t hu_shard_index(const void* ptr, size_t shard_mask)
+{
+  uint64_t key = ((uint64_t)(uintptr_t)ptr >> 4) * 0x9e3779b97f4a7c15ULL;
+  return (size_t)(key >> 32) & shard_mask;
+}
@@ -9,27 +9,47 @@
  */
 
 /* ----------- Includes ------------------------------------------ */
+#include <algorithm>
 #include <atomic>
 #include <cassert>
 #include <cstring>
+#include <ctime>
 #include <iostream>
 #include <fstream>
 #include <mutex>
 #include <queue>
-#include <unordered_map>
-#include <unordered_set>
+#include <vector>
 
 #include <signal.h>
 #include <unistd.h>
 
 #if defined(__APPLE__)
 #include <malloc/malloc.h>
+#else
+#include <malloc.h>
 #endif
 
 #include <sys/mman.h>
 
 #include "hulog.h"
 #include "humain.h"
+#include "humalloc.h"
+#include "hupagemap.h"
+#include "hutable.h"
+
+
+/* ----------- Defines ------------------------------------------- */
+#define HU_SLAB_MAX_PAGES 16      /* Largest slab size class, in user pages */
+#define HU_SLAB_REGION_SLOTS 64   /* Slots mapped at a time per size class */
+#define HU_SLAB_PROTECTED 1       /* Free slot tag, set if slot data is still protected */
+#define HU_QUARANTINE_BATCH_DIV 16   /* Evict batches of this fraction of quarantine max size */
+#define HU_QUARANTINE_CLASSES (HU_SLAB_MAX_PAGES + 1)   /* By user pages, last for all larger */
+
+#if defined(__APPLE__)
+#define HU_MADV_RELEASE MADV_FREE        /* Release physical pages, contents discarded */
+#else
+#define HU_MADV_RELEASE MADV_DONTNEED
+#endif
 
 
 /* ----------- File Global Variables ----------------------------- */
@@ -50,14 +70,94 @@ struct hu_alloc_info
   size_t user_size = 0;
   void* sys_ptr = nullptr;
   size_t sys_size = 0;
+  int slab_class = -1;   /* Slab size class, or -1 if allocated with posix_memalign() */
+  bool resident = false; /* Quarantined with physical pages, as they could not be released */
+};
+
+/*
+ * Slab size classes hold fixed size slots of a given number of user pages,
+ * followed by a fence page if overflow detection is enabled. Slots are
+ * carved out of regions mapped HU_SLAB_REGION_SLOTS at a time, with fence
+ * pages protected once when the region is mapped. Free slots are kept in a
+ * stack mapped outside the slots, so allocating and releasing a slot needs
+ * no system calls, unless use-after-free detection protects it meanwhile.
+ * Slots evicted from quarantine are returned still protected, tagged with
+ * HU_SLAB_PROTECTED, and only made accessible when allocated again.
+ */
+struct hu_slab_class
+{
+  std::mutex mutex;
+  void** free_slots = nullptr;
+  size_t free_count = 0;
+  size_t free_capacity = 0;
+};
+
+/* Allocation tables sharded by pointer hash, each shard with its own lock */
+struct hu_malloc_shard
+{
+  std::mutex mutex;
+  hu_table<bool> user_addrs;
+  hu_table<hu_alloc_info> active_allocs;
+};
+
+static hu_malloc_shard* hu_shards = nullptr;
+static size_t hu_shard_mask = 0;
+
+static hu_slab_class* hu_slab_classes = nullptr;
+
+/* User pointer of block occupying each page, including its fence page */
+static hu_page_map* hu_page_owners = nullptr;
+
+/*
+ * Quarantine is kept per size class, each a FIFO with a share of the max
+ * size. Classes may grow beyond their share while others are below theirs,
+ * and once the total exceeds max size allocations are evicted from the
+ * class most over its share, so that a burst of large blocks does not evict
+ * all small ones. Alternatively the largest blocks are evicted first.
+ */
+struct hu_quarantine_class
+{
+  std::queue<hu_alloc_info> allocs;
+  size_t size = 0;
 };
 
-static std::unordered_set<void*>* hu_user_addrs = nullptr;
-static std::unordered_map<void*, hu_alloc_info>* hu_active_allocs = nullptr;
-static std::queue<hu_alloc_info>* hu_quarantine_allocs = nullptr;
+/* Quarantine state, protected by hu_quarantine_mutex */
+static std::mutex* hu_quarantine_mutex = nullptr;
+static hu_quarantine_class* hu_quarantine_classes = nullptr;
 static size_t hu_quarantine_size = 0;
 static size_t hu_quarantine_max_size = 0;
+static size_t hu_quarantine_class_share = 0;
+static bool hu_quarantine_largest_first = false;
 static bool hu_quarantine_evicted = false;
+static hu_quarantine_stats hu_quarantine_totals;
+static size_t hu_quarantine_resident_size = 0;
+
+/*
+ * Guarded sampling state. The pool is a single mapping of one page slots,
+ * each preceded and followed by a protected guard page, with free slot
+ * indices kept in a FIFO ring so that a free'd slot is reused as late as
+ * possible. Slot state is protected by hu_guard_mutex, while the pool
+ * address range is fixed once mapped.
+ */
+struct hu_guard_slot
+{
+  void* user_ptr = nullptr;
+  size_t user_size = 0;
+  bool in_use = false;
+  bool accessible = false;
+};
+
+static size_t hu_guard_sample = 0;
+static size_t hu_guard_slot_count = 0;
+static char* hu_guard_pool = nullptr;
+static char* hu_guard_pool_end = nullptr;
+static hu_guard_slot* hu_guard_slots = nullptr;
+static std::mutex* hu_guard_mutex = nullptr;
+static size_t* hu_guard_free_ring = nullptr;
+static size_t hu_guard_free_head = 0;
+static size_t hu_guard_free_count = 0;
+static thread_local uint64_t hu_guard_rng = 0;
+static thread_local uint64_t hu_guard_countdown = 0;
 
 
 /* ----------- Local Functions ----------------------------------- */
@@ -71,9 +171,9 @@ static inline size_t hu_round_up(size_t num_to_round, size_t multiple)
   return (num_to_round + multiple - remainder);
 }
 
-static inline size_t hu_calc_user_size(size_t user_size)
+static inline size_t hu_calc_user_size(size_t user_size, size_t alignment = 0)
 {
-  const size_t rounded_user_size = hu_round_up(user_size, hu_size_multiple);
+  const size_t rounded_user_size = hu_round_up(user_size, std::max(alignment, hu_size_multiple));
   return rounded_user_size;
 }
 
@@ -84,12 +184,28 @@ static inline size_t hu_calc_sys_size(size_t user_size)
   return padded_size;
 }
 
+/* Untracked allocation from the system allocator */
+static void* hu_sys_alloc(size_t user_size, size_t alignment)
+{
+  if (alignment <= hu_size_multiple) return malloc(user_size);
+
+  void* ptr = nullptr;
+  return (posix_memalign(&ptr, alignment, user_size) == 0) ? ptr : nullptr;
+}
+
+static inline hu_malloc_shard& hu_shard(void* user_ptr)
+{
+  return hu_shards[hu_shard_index(user_ptr, hu_shard_mask)];
+}
+
 static inline bool hu_get_allocinfo(void* user_ptr, hu_alloc_info* alloc_info)
 {
-  auto it = hu_active_allocs->find(user_ptr);
-  if (it == hu_active_allocs->end()) return false;
+  hu_malloc_shard& shard = hu_shard(user_ptr);
+  std::lock_guard<std::mutex> lock(shard.mutex);
+  hu_alloc_info* info = shard.active_allocs.find(user_ptr);
+  if (info == nullptr) return false;
 
-  *alloc_info = it->second;
+  *alloc_info = *info;
   return true;
 }
 
@@ -130,16 +246,356 @@ static int hu_mprotect(void* addr, size_t len, int prot)
 }
 
 
+static inline size_t hu_slab_slot_size(int slab_class)
+{
+  return ((size_t)(slab_class + 1) * hu_page_size) + (hu_overflow ? hu_page_size : 0);
+}
+
+/* Grow free slot stack, caller must hold class mutex */
+static bool hu_slab_reserve(hu_slab_class& slab, size_t count)
+{
+  if ((slab.free_count + count) <= slab.free_capacity) return true;
+
+  const size_t capacity = std::max(slab.free_capacity * 2, slab.free_count + count);
+  void* mem = mmap(nullptr, capacity * sizeof(void*), PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (mem == MAP_FAILED) return false;
+
+  if (slab.free_slots != nullptr)
+  {
+    memcpy(mem, slab.free_slots, slab.free_count * sizeof(void*));
+    munmap(slab.free_slots, slab.free_capacity * sizeof(void*));
+  }
+
+  slab.free_slots = (void**)mem;
+  slab.free_capacity = capacity;
+  return true;
+}
+
+/* Map a new region of slots, caller must hold class mutex */
+static bool hu_slab_grow(hu_slab_class& slab, int slab_class)
+{
+  if (!hu_slab_reserve(slab, HU_SLAB_REGION_SLOTS)) return false;
+
+  const size_t slot_size = hu_slab_slot_size(slab_class);
+  void* mem = mmap(nullptr, slot_size * HU_SLAB_REGION_SLOTS, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (mem == MAP_FAILED) return false;
+
+  /* Push in reverse, so slots are handed out in address order */
+  for (size_t i = HU_SLAB_REGION_SLOTS; i > 0; --i)
+  {
+    char* slot = (char*)mem + ((i - 1) * slot_size);
+    if (hu_overflow)
+    {
+      hu_mprotect(slot + slot_size - hu_page_size, hu_page_size, PROT_NONE);
+    }
+
+    slab.free_slots[slab.free_count++] = slot;
+  }
+
+  return true;
+}
+
+static inline uintptr_t hu_page_of(const void* ptr)
+{
+  return (uintptr_t)ptr / hu_page_size;
+}
+
+static void* hu_slab_alloc(int slab_class)
+{
+  void* slot = nullptr;
+  {
+    hu_slab_class& slab = hu_slab_classes[slab_class];
+    std::lock_guard<std::mutex> lock(slab.mutex);
+    if ((slab.free_count == 0) && !hu_slab_grow(slab, slab_class)) return nullptr;
+
+    slot = slab.free_slots[--slab.free_count];
+  }
+
+  if (((uintptr_t)slot & HU_SLAB_PROTECTED) != 0)
+  {
+    slot = (void*)((uintptr_t)slot & ~(uintptr_t)HU_SLAB_PROTECTED);
+    const size_t data_size = hu_slab_slot_size(slab_class) - (hu_overflow ? hu_page_size : 0);
+    if (hu_mprotect(slot, data_size, PROT_READ | PROT_WRITE) != 0)
+    {
+      /* Keep slot out of use */
+      return nullptr;
+    }
+  }
+
+  return slot;
+}
+
+/* Return slot, which must be accessible (fence page excepted) unless is_protected */
+static void hu_slab_release(int slab_class, void* slot, bool is_protected)
+{
+  hu_slab_class& slab = hu_slab_classes[slab_class];
+  std::lock_guard<std::mutex> lock(slab.mutex);
+
+  /* Keep slot out of use if its stack cannot be grown */
+  if (!hu_slab_reserve(slab, 1)) return;
+
+  slab.free_slots[slab.free_count++] = (void*)((uintptr_t)slot | (is_protected ? HU_SLAB_PROTECTED : 0));
+}
+
+/* Release memory of an allocation, made accessible again unless a protected slab slot */
+static void hu_sys_release(const hu_alloc_info& alloc_info, bool is_protected = false)
+{
+  hu_page_owners->set(hu_page_of(alloc_info.sys_ptr), alloc_info.sys_size / hu_page_size, nullptr);
+  if (alloc_info.slab_class >= 0)
+  {
+    hu_slab_release(alloc_info.slab_class, alloc_info.sys_ptr, is_protected);
+  }
+  else
+  {
+    free(alloc_info.sys_ptr);
+  }
+}
+
+/* Size of allocation made inaccessible when quarantined, excluding fence page */
+static inline size_t hu_sys_data_size(const hu_alloc_info& alloc_info)
+{
+  return alloc_info.sys_size - (hu_overflow ? hu_page_size : 0);
+}
+
+static inline int hu_quarantine_class_of(const hu_alloc_info& alloc_info)
+{
+  const size_t user_pages = hu_sys_data_size(alloc_info) / hu_page_size;
+  return (int)std::min(user_pages, (size_t)HU_QUARANTINE_CLASSES) - 1;
+}
+
+/* Class to evict from, caller must hold hu_quarantine_mutex */
+static int hu_quarantine_victim()
+{
+  int victim = -1;
+  long long victim_excess = 0;
+  for (int i = HU_QUARANTINE_CLASSES - 1; i >= 0; --i)
+  {
+    const hu_quarantine_class& qclass = hu_quarantine_classes[i];
+    if (qclass.allocs.empty()) continue;
+
+    if (hu_quarantine_largest_first) return i;
+
+    const long long excess = (long long)qclass.size - (long long)hu_quarantine_class_share;
+    if ((victim == -1) || (excess > victim_excess))
+    {
+      victim = i;
+      victim_excess = excess;
+    }
+  }
+
+  return victim;
+}
+
+/*
+ * Release a batch of allocations evicted from quarantine, whose physical
+ * pages were already released when quarantined. Without fence pages a run
+ * of adjacent slab slots is contiguous data, made accessible by a single
+ * mprotect(), otherwise slots are returned still protected. Other
+ * allocations are made accessible and free'd individually. Blocks stop
+ * being tracked as free'd before their memory can be reused.
+ */
+static void hu_quarantine_release(std::vector<hu_alloc_info>& batch)
+{
+  for (const hu_alloc_info& alloc_info : batch)
+  {
+    hu_log_remove_freed_allocation(alloc_info.user_ptr);
+  }
+
+  std::sort(batch.begin(), batch.end(),
+            [](const hu_alloc_info& lhs, const hu_alloc_info& rhs) { return lhs.sys_ptr < rhs.sys_ptr; });
+
+  size_t i = 0;
+  while (i < batch.size())
+  {
+    if (batch[i].slab_class < 0)
+    {
+      hu_mprotect(batch[i].sys_ptr, batch[i].sys_size, PROT_READ | PROT_WRITE);
+      hu_sys_release(batch[i]);
+      ++i;
+      continue;
+    }
+
+    size_t end = i + 1;
+    while ((end < batch.size()) && (batch[end].slab_class >= 0) &&
+           (batch[end].sys_ptr == ((char*)batch[end - 1].sys_ptr + batch[end - 1].sys_size)))
+    {
+      ++end;
+    }
+
+    const size_t run_size = ((char*)batch[end - 1].sys_ptr + batch[end - 1].sys_size) - (char*)batch[i].sys_ptr;
+    const bool is_protected = hu_overflow || (hu_mprotect(batch[i].sys_ptr, run_size, PROT_READ | PROT_WRITE) != 0);
+    for (; i < end; ++i)
+    {
+      hu_sys_release(batch[i], is_protected);
+    }
+  }
+}
+
+
+
+static inline bool hu_guard_contains(const void* ptr)
+{
+  return ((const char*)ptr >= hu_guard_pool) && ((const char*)ptr < hu_guard_pool_end);
+}
+
+static inline char* hu_guard_slot_ptr(size_t index)
+{
+  return hu_guard_pool + (((2 * index) + 1) * hu_page_size);
+}
+
+/* Slot index of an address in the pool, guard pages belong to the slot after */
+static inline size_t hu_guard_slot_index(const void* ptr)
+{
+  return (size_t)((const char*)ptr - hu_guard_pool) / (2 * hu_page_size);
+}
+
+/*
+ * Sampling interval drawn uniformly from [1, 2 * hu_guard_sample - 1], so
+ * that on average one in hu_guard_sample allocations is sampled, without a
+ * fixed stride that a regular allocation pattern could keep missing.
+ */
+static inline uint64_t hu_guard_interval()
+{
+  hu_guard_rng ^= hu_guard_rng >> 12;
+  hu_guard_rng ^= hu_guard_rng << 25;
+  hu_guard_rng ^= hu_guard_rng >> 27;
+  return 1 + ((hu_guard_rng * 0x2545f4914f6cdd1dULL) % ((2 * hu_guard_sample) - 1));
+}
+
+static inline bool hu_guard_should_sample()
+{
+  if (hu_guard_rng == 0)
+  {
+    hu_guard_rng = ((uint64_t)(uintptr_t)&hu_guard_rng ^ (uint64_t)time(nullptr)) | 1;
+    hu_guard_countdown = hu_guard_interval();
+  }
+
+  if (--hu_guard_countdown > 0) return false;
+
+  hu_guard_countdown = hu_guard_interval();
+  return true;
+}
+
+static bool hu_guard_init(size_t slot_count)
+{
+  const size_t pool_size = ((2 * slot_count) + 1) * hu_page_size;
+  void* mem = mmap(nullptr, pool_size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (mem == MAP_FAILED) return false;
+
+  hu_guard_slots = new hu_guard_slot[slot_count];
+  hu_guard_free_ring = new size_t[slot_count];
+  for (size_t i = 0; i < slot_count; ++i)
+  {
+    hu_guard_free_ring[i] = i;
+  }
+
+  hu_guard_mutex = new std::mutex();
+  hu_guard_slot_count = slot_count;
+  hu_guard_free_head = 0;
+  hu_guard_free_count = slot_count;
+  hu_guard_pool = (char*)mem;
+  hu_guard_pool_end = hu_guard_pool + pool_size;
+  return true;
+}
+
+/* Place a sampled allocation in a free slot, or return nullptr if not sampled */
+static void* hu_guard_alloc(size_t user_size, size_t alignment)
+{
+  /* Block end is at page boundary, so rounding to alignment also aligns its start */
+  const size_t rounded_user_size = hu_calc_user_size(user_size, alignment);
+  if ((rounded_user_size > (size_t)hu_page_size) || !hu_guard_should_sample()) return nullptr;
+
+  void* evicted_user_ptr = nullptr;
+  void* user_ptr = nullptr;
+  {
+    std::lock_guard<std::mutex> lock(*hu_guard_mutex);
+    if (hu_guard_free_count == 0) return nullptr;
+
+    const size_t index = hu_guard_free_ring[hu_guard_free_head];
+    hu_guard_free_head = (hu_guard_free_head + 1) % hu_guard_slot_count;
+    --hu_guard_free_count;
+
+    hu_guard_slot& slot = hu_guard_slots[index];
+    char* slot_ptr = hu_guard_slot_ptr(index);
+    if (!slot.accessible)
+    {
+      if (hu_mprotect(slot_ptr, hu_page_size, PROT_READ | PROT_WRITE) != 0)
+      {
+        /* Keep slot out of use */
+        return nullptr;
+      }
+
+      slot.accessible = true;
+    }
+
+    /* Reusing a slot ends use-after-free detection for its previous block */
+    evicted_user_ptr = slot.user_ptr;
+
+    /* Place block at end of slot, against the following guard page */
+    user_ptr = slot_ptr + hu_page_size - rounded_user_size;
+    slot.user_ptr = user_ptr;
+    slot.user_size = user_size;
+    slot.in_use = true;
+  }
+
+  if (hu_useafterfree && (evicted_user_ptr != nullptr))
+  {
+    hu_log_remove_freed_allocation(evicted_user_ptr);
+  }
+
+  return user_ptr;
+}
+
+static void hu_guard_free(void* user_ptr)
+{
+  std::lock_guard<std::mutex> lock(*hu_guard_mutex);
+  const size_t index = hu_guard_slot_index(user_ptr);
+  hu_guard_slot& slot = hu_guard_slots[index];
+  if (!slot.in_use || (slot.user_ptr != user_ptr))
+  {
+    /* Double-free or invalid pointer, ignored here and handled in log_event() */
+    return;
+  }
+
+  /* Protect free'd slot until reused, if use-after-free detection is enabled */
+  if (hu_useafterfree && (hu_mprotect(hu_guard_slot_ptr(index), hu_page_size, PROT_NONE) == 0))
+  {
+    slot.accessible = false;
+  }
+
+  slot.in_use = false;
+  hu_guard_free_ring[(hu_guard_free_head + hu_guard_free_count) % hu_guard_slot_count] = index;
+  ++hu_guard_free_count;
+}
+
+static bool hu_guard_get_allocinfo(void* user_ptr, hu_alloc_info* alloc_info)
+{
+  if (!hu_guard_contains(user_ptr)) return false;
+
+  std::lock_guard<std::mutex> lock(*hu_guard_mutex);
+  const hu_guard_slot& slot = hu_guard_slots[hu_guard_slot_index(user_ptr)];
+  if (!slot.in_use || (slot.user_ptr != user_ptr)) return false;
+
+  alloc_info->user_ptr = slot.user_ptr;
+  alloc_info->user_size = slot.user_size;
+  return true;
+}
+
+
 /* ----------- Global Functions ---------------------------------- */
-void hu_malloc_init(bool overflow, bool useafterfree, size_t minsize, int quarantine_pct)
+void hu_malloc_init(const hu_malloc_config& config)
 {
-  hu_overflow = overflow;
-  hu_useafterfree = useafterfree;
-  hu_minsize = minsize;
+  hu_overflow = config.overflow;
+  hu_useafterfree = config.useafterfree;
+  hu_minsize = config.minsize;
 
   hu_num_pages = sysconf(_SC_PHYS_PAGES);
   hu_page_size = sysconf(_SC_PAGE_SIZE);
-  hu_quarantine_max_size = (((size_t)hu_num_pages * (size_t)hu_page_size) * quarantine_pct / 100);
+  hu_quarantine_max_size = (((size_t)hu_num_pages * (size_t)hu_page_size) * config.quarantine_pct / 100);
+  hu_quarantine_class_share = hu_quarantine_max_size / HU_QUARANTINE_CLASSES;
+  hu_quarantine_largest_first = config.quarantine_largest_first;
 
   struct sigaction sa;
   sa.sa_flags = SA_SIGINFO;
@@ -151,9 +607,24 @@ void hu_malloc_init(bool overflow, bool useafterfree, size_t minsize, int quaran
   sigaction(SIGBUS, &sa, nullptr);
 #endif
 
-  hu_user_addrs = new std::unordered_set<void*>();
-  hu_active_allocs = new std::unordered_map<void*, hu_alloc_info>();
-  hu_quarantine_allocs = new std::queue<hu_alloc_info>();
+  hu_shards = new hu_malloc_shard[config.shards];
+  hu_shard_mask = config.shards - 1;
+  hu_slab_classes = new hu_slab_class[HU_SLAB_MAX_PAGES];
+  hu_page_owners = new hu_page_map();
+  hu_quarantine_mutex = new std::mutex();
+  hu_quarantine_classes = new hu_quarantine_class[HU_QUARANTINE_CLASSES];
+
+  if ((config.guard_sample != 0) && (config.guard_slots != 0))
+  {
+    if (hu_guard_init(config.guard_slots))
+    {
+      hu_guard_sample = config.guard_sample;
+    }
+    else
+    {
+      fprintf(stderr, "heapusage error: unable to map guarded pool, guarding all allocations\n");
+    }
+  }
 
   hu_malloc_inited = true;
 }
@@ -177,39 +648,87 @@ void hu_malloc_cleanup()
  *      |                   |
  *   sys_ptr             user_ptr
  *
+ * Allocations of up to HU_SLAB_MAX_PAGES pages take a slot of the matching
+ * slab size class, with the fence page already protected. Larger ones are
+ * allocated with posix_memalign() and protected individually.
+ *
+ * Aligned allocations are placed the same way, with the user size rounded
+ * up to the alignment, so that a user pointer placed against the fence page
+ * is aligned. Alignments beyond page size are not taken from slabs, but
+ * allocated with posix_memalign() at that alignment, where the user pointer
+ * is then at the start of the block.
+ *
  * Free'd user allocations are placed in a quarantine queue and fully
  * read/write protected from further access. The queue has a max size (currently
  * 10% of physical system RAM), and once full, the oldest allocations are made
  * unprotected and free'd/returned back to the OS. At this point access to a
  * free'd allocation cannot be detected anymore.
  *
+ * With guarded sampling enabled (hu_guard_sample non-zero), only one in
+ * hu_guard_sample allocations of up to a page is placed in a slot of the
+ * fixed guarded pool, and all others are passed straight to the system
+ * allocator without any tracking. Free'd slots serve as quarantine until
+ * reused.
+ *
  */
 void* hu_malloc(size_t user_size)
 {
+  return hu_memalign(hu_size_multiple, user_size);
+}
+
+void* hu_memalign(size_t alignment, size_t user_size)
+{
+  /* Alignment is a power of two, and at least the default */
+  size_t block_alignment = hu_size_multiple;
+  while (block_alignment < alignment)
+  {
+    block_alignment <<= 1;
+  }
+
+  alignment = block_alignment;
+
   if (!hu_malloc_inited)
   {
-    return malloc(user_size);
+    return hu_sys_alloc(user_size, alignment);
   }
 
   if (user_size == 0)
   {
-    return malloc(user_size);
+    return hu_sys_alloc(user_size, alignment);
   }
 
   if (user_size < hu_minsize)
   {
-    return malloc(user_size);
+    return hu_sys_alloc(user_size, alignment);
+  }
+
+  if (hu_guard_sample != 0)
+  {
+    void* user_ptr = hu_guard_alloc(user_size, alignment);
+    return (user_ptr != nullptr) ? user_ptr : hu_sys_alloc(user_size, alignment);
   }
 
   /* Calculate rounded user size */
-  const size_t rounded_user_size = hu_calc_user_size(user_size);
+  const size_t rounded_user_size = hu_calc_user_size(user_size, alignment);
 
   /* Calculate system memory needed */
   const size_t sys_size = hu_calc_sys_size(rounded_user_size);
 
-  /* Allocate aligned at page size */
+  /* Take a slot of fitting slab size class, or allocate aligned at page size */
+  const size_t user_pages = (sys_size / hu_page_size) - (hu_overflow ? 1 : 0);
+  int slab_class = -1;
   void* sys_ptr = nullptr;
-  if (posix_memalign(&sys_ptr, hu_page_size, sys_size) != 0)
+  if ((user_pages <= HU_SLAB_MAX_PAGES) && (alignment <= (size_t)hu_page_size))
+  {
+    sys_ptr = hu_slab_alloc((int)user_pages - 1);
+    if (sys_ptr != nullptr)
+    {
+      slab_class = (int)user_pages - 1;
+    }
+  }
+
+  if ((sys_ptr == nullptr) &&
+      (posix_memalign(&sys_ptr, std::max(alignment, (size_t)hu_page_size), sys_size) != 0))
   {
     sys_ptr = nullptr;
   }
@@ -224,7 +743,10 @@ void* hu_malloc(size_t user_size)
   if (hu_overflow)
   {
     post_fence_ptr = (char*)sys_ptr + sys_size - hu_page_size;
-    hu_mprotect(post_fence_ptr, hu_page_size, PROT_NONE);
+    if (slab_class < 0)
+    {
+      hu_mprotect(post_fence_ptr, hu_page_size, PROT_NONE);
+    }
   }
 
   /* Calculate user pointer */
@@ -244,9 +766,24 @@ void* hu_malloc(size_t user_size)
   allocInfo.user_size = user_size;
   allocInfo.sys_ptr = sys_ptr;
   allocInfo.sys_size = sys_size;
-  hu_active_allocs->insert(std::pair<void*, hu_alloc_info>(user_ptr, allocInfo));
+  allocInfo.slab_class = slab_class;
+  hu_malloc_shard& shard = hu_shard(user_ptr);
+  std::unique_lock<std::mutex> lock(shard.mutex);
+  if (!shard.active_allocs.insert(user_ptr, allocInfo) || !shard.user_addrs.insert(user_ptr, true))
+  {
+    /* Unable to track, fall back to a regular allocation */
+    shard.active_allocs.erase(user_ptr);
+    lock.unlock();
+    if (slab_class < 0)
+    {
+      hu_mprotect(sys_ptr, sys_size, PROT_READ | PROT_WRITE);
+    }
+    hu_sys_release(allocInfo);
+    return hu_sys_alloc(user_size, alignment);
+  }
 
-  hu_user_addrs->insert(user_ptr);
+  lock.unlock();
+  hu_page_owners->set(hu_page_of(sys_ptr), sys_size / hu_page_size, user_ptr);
 
   return user_ptr;
 }
@@ -260,49 +797,89 @@ void hu_free(void* user_ptr)
 
   if (user_ptr == nullptr) return;
 
-  if (!hu_user_addrs->count(user_ptr))
+  if (hu_guard_sample != 0)
   {
-    free(user_ptr);
+    hu_guard_contains(user_ptr) ? hu_guard_free(user_ptr) : free(user_ptr);
     return;
   }
 
   /* Get allocation details */
   hu_alloc_info allocInfo;
-  if (!hu_get_allocinfo(user_ptr, &allocInfo))
   {
-    /* Double-free, ignored here and handled in log_event() */
-    /* @todo: consider adding option to actually call free() here */
-    return;
-  }
+    hu_malloc_shard& shard = hu_shard(user_ptr);
+    std::unique_lock<std::mutex> lock(shard.mutex);
+    if (!shard.user_addrs.contains(user_ptr))
+    {
+      lock.unlock();
+      free(user_ptr);
+      return;
+    }
 
-  hu_active_allocs->erase(user_ptr);
+    if (!shard.active_allocs.erase(user_ptr, &allocInfo))
+    {
+      /* Double-free, ignored here and handled in log_event() */
+      /* @todo: consider adding option to actually call free() here */
+      return;
+    }
+  }
 
   if (hu_useafterfree)
   {
-    /* Quarantine allocation if use-after-free detection is enabled */
-    hu_mprotect(allocInfo.sys_ptr, allocInfo.sys_size, PROT_NONE);
-
-    hu_quarantine_allocs->push(allocInfo);
-    hu_quarantine_size += allocInfo.sys_size;
+    /*
+     * Quarantine allocation if use-after-free detection is enabled. Its
+     * pages stay mapped but inaccessible, and are released to the kernel,
+     * so the quarantine takes address space rather than physical memory.
+     */
+    hu_mprotect(allocInfo.sys_ptr, hu_sys_data_size(allocInfo), PROT_NONE);
+    allocInfo.resident = (madvise(allocInfo.sys_ptr, hu_sys_data_size(allocInfo), HU_MADV_RELEASE) != 0);
+
+    std::vector<hu_alloc_info> evicted;
+    {
+      std::lock_guard<std::mutex> lock(*hu_quarantine_mutex);
+      hu_quarantine_class& qclass = hu_quarantine_classes[hu_quarantine_class_of(allocInfo)];
+      qclass.allocs.push(allocInfo);
+      qclass.size += allocInfo.sys_size;
+      hu_quarantine_size += allocInfo.sys_size;
+      hu_quarantine_resident_size += allocInfo.resident ? hu_sys_data_size(allocInfo) : 0;
+      hu_quarantine_totals.blocks += 1;
+      hu_quarantine_totals.bytes += allocInfo.sys_size;
+
+      /* Once over max size, release a batch of allocations back to OS, oldest first per class */
+      if (hu_quarantine_size > hu_quarantine_max_size)
+      {
+        const size_t target_size = hu_quarantine_max_size - (hu_quarantine_max_size / HU_QUARANTINE_BATCH_DIV);
+        int victim = 0;
+        while ((hu_quarantine_size > target_size) && ((victim = hu_quarantine_victim()) >= 0))
+        {
+          hu_quarantine_class& vclass = hu_quarantine_classes[victim];
+          const hu_alloc_info& delete_alloc_info = vclass.allocs.front();
+          hu_quarantine_evicted = true;
+          hu_quarantine_totals.evicted_blocks += 1;
+          hu_quarantine_totals.evicted_bytes += delete_alloc_info.sys_size;
+          vclass.size -= delete_alloc_info.sys_size;
+          hu_quarantine_size -= delete_alloc_info.sys_size;
+          hu_quarantine_resident_size -= delete_alloc_info.resident ? hu_sys_data_size(delete_alloc_info) : 0;
+          evicted.push_back(delete_alloc_info);
+          vclass.allocs.pop();
+        }
+      }
+    }
 
-    /* Release quarantined allocations back to OS if over max size */
-    while ((hu_quarantine_size > hu_quarantine_max_size) && !hu_quarantine_allocs->empty())
+    if (!evicted.empty())
     {
-      hu_quarantine_evicted = true;
-      hu_alloc_info delete_alloc_info = hu_quarantine_allocs->front();
-      hu_quarantine_allocs->pop();
-
-      hu_mprotect(delete_alloc_info.sys_ptr, delete_alloc_info.sys_size, PROT_READ | PROT_WRITE);
-      hu_quarantine_size -= delete_alloc_info.sys_size;
-      free(delete_alloc_info.sys_ptr);
-      hu_log_remove_freed_allocation(delete_alloc_info.user_ptr);
+      hu_quarantine_release(evicted);
     }
   }
+  else if (allocInfo.slab_class >= 0)
+  {
+    /* Slot is returned with fence page still protected */
+    hu_sys_release(allocInfo);
+  }
   else
   {
     /* Directly unprotect and release back to OS if use-after-free detection is disabled */
     hu_mprotect(allocInfo.sys_ptr, allocInfo.sys_size, PROT_READ | PROT_WRITE);
-    free(allocInfo.sys_ptr);
+    hu_sys_release(allocInfo);
   }
 }
 
@@ -354,7 +931,8 @@ void* hu_realloc(void* user_ptr, size_t user_size)
   }
 
   hu_alloc_info allocInfo;
-  if (hu_get_allocinfo(user_ptr, &allocInfo))
+  if ((hu_guard_sample != 0) ? hu_guard_get_allocinfo(user_ptr, &allocInfo) :
+      hu_get_allocinfo(user_ptr, &allocInfo))
   {
     void* new_user_ptr = hu_malloc(user_size);
     if (new_user_ptr != nullptr)
@@ -376,7 +954,8 @@ void* hu_realloc(void* user_ptr, size_t user_size)
 size_t hu_malloc_size(void* user_ptr)
 {
   hu_alloc_info allocInfo;
-  if (hu_malloc_inited && hu_get_allocinfo(user_ptr, &allocInfo))
+  if (hu_malloc_inited && ((hu_guard_sample != 0) ? hu_guard_get_allocinfo(user_ptr, &allocInfo) :
+                           hu_get_allocinfo(user_ptr, &allocInfo)))
   {
     const size_t rounded_user_size = hu_calc_user_size(allocInfo.user_size);
     return rounded_user_size;
@@ -386,7 +965,7 @@ size_t hu_malloc_size(void* user_ptr)
 #if defined(__APPLE__)
     return malloc_size(user_ptr);
 #else
-    return 0;
+    return malloc_usable_size(user_ptr);
 #endif
   }
 }
@@ -395,3 +974,69 @@ bool hu_quarantine_was_evicted()
 {
   return hu_quarantine_evicted;
 }
+
+void hu_quarantine_get_stats(hu_quarantine_stats* stats)
+{
+  if (hu_quarantine_mutex == nullptr)
+  {
+    *stats = hu_quarantine_stats();
+    return;
+  }
+
+  /*
+   * Physical pages of quarantined blocks are released when quarantined, so
+   * only those that could not be are counted as resident.
+   */
+  std::lock_guard<std::mutex> lock(*hu_quarantine_mutex);
+  *stats = hu_quarantine_totals;
+  stats->virtual_bytes = hu_quarantine_size;
+  stats->resident_bytes = hu_quarantine_resident_size;
+}
+
+bool hu_malloc_is_unsampled(const void* ptr)
+{
+  return (hu_guard_sample != 0) && !hu_guard_contains(ptr);
+}
+
+/*
+ * Find blocks neighboring a faulting address: the block occupying its page
+ * (the fence page included), and the block starting on the following page.
+ * Called from the signal handler, so no locks are taken.
+ */
+void hu_malloc_find_blocks(void* addr, void** owner, void** next)
+{
+  *owner = nullptr;
+  *next = nullptr;
+  if (!hu_malloc_inited) return;
+
+  if (hu_guard_contains(addr))
+  {
+    /* Even pool pages are guard pages, with one slot before and one after */
+    const size_t page = (size_t)((char*)addr - hu_guard_pool) / hu_page_size;
+    const size_t index = page / 2;
+    if ((page % 2) == 1)
+    {
+      *owner = hu_guard_slots[index].user_ptr;
+    }
+    else
+    {
+      *owner = (index > 0) ? hu_guard_slots[index - 1].user_ptr : nullptr;
+      *next = (index < hu_guard_slot_count) ? hu_guard_slots[index].user_ptr : nullptr;
+    }
+
+    return;
+  }
+
+  const uintptr_t page = hu_page_of(addr);
+  *owner = hu_page_owners->get(page);
+  void* next_owner = hu_page_owners->get(page + 1);
+  if ((next_owner != nullptr) && (next_owner != *owner))
+  {
+    *next = next_owner;
+  }
+}
+
+bool hu_malloc_is_guarded()
+{
+  return (hu_guard_sample != 0);
+}
@@ -8,13 +8,42 @@
  *
  */
 
+/* ----------- Types --------------------------------------------- */
+struct hu_malloc_config
+{
+  bool overflow = false;
+  bool useafterfree = false;
+  size_t minsize = 0;
+  int quarantine_pct = 10;                 /* Quarantine limit as percentage of RAM */
+  bool quarantine_largest_first = false;   /* Evict largest blocks first */
+  size_t shards = 64;                      /* Allocation shards, power of two */
+  size_t guard_sample = 0;                 /* Guard one in N allocations, zero if all */
+  size_t guard_slots = 0;                  /* Guarded pool slots */
+};
+
+struct hu_quarantine_stats
+{
+  unsigned long long blocks = 0;           /* Quarantined in total */
+  unsigned long long bytes = 0;
+  unsigned long long evicted_blocks = 0;   /* Released before end of tracking */
+  unsigned long long evicted_bytes = 0;
+  unsigned long long virtual_bytes = 0;    /* Currently quarantined */
+  unsigned long long resident_bytes = 0;
+};
+
+
 /* ----------- Global Function Prototypes ------------------------ */
-void hu_malloc_init(bool overflow, bool useafterfree, size_t minsize, int quarantine_pct);
+void hu_malloc_init(const hu_malloc_config& config);
 void hu_malloc_cleanup();
 
 void* hu_malloc(size_t user_size);
+void* hu_memalign(size_t alignment, size_t user_size);
 void hu_free(void* ptr);
 void* hu_calloc(size_t count, size_t size);
 void* hu_realloc(void* ptr, size_t size);
 size_t hu_malloc_size(void* ptr);
 bool hu_quarantine_was_evicted();
+void hu_quarantine_get_stats(hu_quarantine_stats* stats);
+bool hu_malloc_is_unsampled(const void* ptr);
+void hu_malloc_find_blocks(void* addr, void** owner, void** next);
+bool hu_malloc_is_guarded();
@@ -0,0 +1,111 @@
+/*
+ * hupagemap.h
+ *
+ * Copyright (C) 2026 Kristofer Berggren
+ * All rights reserved.
+ *
+ * heapusage is distributed under the BSD 3-Clause license, see LICENSE for details.
+ *
+ */
+
+#pragma once
+
+/* ----------- Includes ------------------------------------------ */
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+#include <sys/mman.h>
+
+
+/* ----------- Defines ------------------------------------------- */
+#define HU_PAGE_MAP_LEVEL_BITS 12   /* Page number bits per radix tree level */
+#define HU_PAGE_MAP_LEVEL_SIZE (1UL << HU_PAGE_MAP_LEVEL_BITS)
+
+
+/* ----------- Types --------------------------------------------- */
+/*
+ * hu_page_map maps page numbers to a pointer value, typically the user
+ * pointer of the block occupying the page. It is a three level radix tree
+ * covering page numbers of up to 3 * HU_PAGE_MAP_LEVEL_BITS bits, with inner
+ * and leaf nodes mapped directly with mmap() on first use and never freed.
+ *
+ * Updates of distinct pages may be made concurrently, and lookups take no
+ * locks, so they can also be made from a signal handler.
+ */
+class hu_page_map
+{
+public:
+  hu_page_map()
+  {
+    for (size_t i = 0; i < HU_PAGE_MAP_LEVEL_SIZE; ++i)
+    {
+      m_root[i].store(nullptr, std::memory_order_relaxed);
+    }
+  }
+
+  hu_page_map(const hu_page_map&) = delete;
+  hu_page_map& operator=(const hu_page_map&) = delete;
+
+  /* Set value of count pages starting at page, returns false if a node could not be mapped */
+  bool set(uintptr_t page, size_t count, void* value)
+  {
+    for (size_t i = 0; i < count; ++i)
+    {
+      std::atomic<void*>* entry = hu_page_map_entry(page + i, true);
+      if (entry == nullptr) return false;
+
+      entry->store(value, std::memory_order_release);
+    }
+
+    return true;
+  }
+
+  void* get(uintptr_t page) const
+  {
+    std::atomic<void*>* entry = const_cast<hu_page_map*>(this)->hu_page_map_entry(page, false);
+    return (entry != nullptr) ? entry->load(std::memory_order_acquire) : nullptr;
+  }
+
+private:
+  struct hu_page_map_node
+  {
+    std::atomic<void*> slots[HU_PAGE_MAP_LEVEL_SIZE];
+  };
+
+  static hu_page_map_node* hu_page_map_child(std::atomic<void*>& slot, bool create)
+  {
+    void* node = slot.load(std::memory_order_acquire);
+    if ((node != nullptr) || !create) return (hu_page_map_node*)node;
+
+    /* Anonymous mappings are zero-filled, i.e. all slots nullptr */
+    void* mem = mmap(nullptr, sizeof(hu_page_map_node), PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) return nullptr;
+
+    if (!slot.compare_exchange_strong(node, mem, std::memory_order_acq_rel))
+    {
+      /* Another thread installed it first */
+      munmap(mem, sizeof(hu_page_map_node));
+      return (hu_page_map_node*)node;
+    }
+
+    return (hu_page_map_node*)mem;
+  }
+
+  std::atomic<void*>* hu_page_map_entry(uintptr_t page, bool create)
+  {
+    const uintptr_t mask = HU_PAGE_MAP_LEVEL_SIZE - 1;
+    if ((page >> (3 * HU_PAGE_MAP_LEVEL_BITS)) != 0) return nullptr;
+
+    hu_page_map_node* mid = hu_page_map_child(m_root[page >> (2 * HU_PAGE_MAP_LEVEL_BITS)], create);
+    if (mid == nullptr) return nullptr;
+
+    hu_page_map_node* leaf = hu_page_map_child(mid->slots[(page >> HU_PAGE_MAP_LEVEL_BITS) & mask], create);
+    if (leaf == nullptr) return nullptr;
+
+    return &leaf->slots[page & mask];
+  }
+
+  std::atomic<void*> m_root[HU_PAGE_MAP_LEVEL_SIZE];
+};
@@ -0,0 +1,204 @@
+/*
+ * hustack.cpp
+ *
+ * Copyright (C) 2026 Kristofer Berggren
+ * All rights reserved.
+ *
+ * heapusage is distributed under the BSD 3-Clause license, see LICENSE for details.
+ *
+ */
+
+/* ----------- Includes ------------------------------------------ */
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+
+#include <sys/mman.h>
+
+#include "hulog.h"
+#include "hustack.h"
+
+
+/* ----------- Defines ------------------------------------------- */
+#define HU_STACK_BUCKETS (1 << 20)    /* Hash buckets, must be power of two */
+#define HU_STACK_LOCKS 64             /* Insert lock stripes, must be power of two */
+#define HU_STACK_CHUNK_SIZE 4096      /* Entries per arena chunk */
+#define HU_STACK_MAX_CHUNKS (HU_STACK_MAX_IDS / HU_STACK_CHUNK_SIZE)   /* Arena chunks */
+
+
+/* ----------- Types --------------------------------------------- */
+struct hu_stack_entry
+{
+  uint32_t next;
+  uint32_t hash;
+  int depth;
+  void* frames[MAX_CALL_STACK];
+  std::atomic<long long> live_bytes;    /* Tracked blocks in use, see hu_stack_add_live() */
+  std::atomic<long long> live_blocks;
+};
+
+
+/* ----------- File Global Variables ----------------------------- */
+/*
+ * The stack depot interns each unique callstack once in an append-only arena
+ * and identifies it by a 32-bit id. Entries are immutable once published, so
+ * lookups are lock-free; only inserting a new stack takes a lock, striped by
+ * hash bucket. The exception is the live block counters of each entry, which
+ * are updated atomically, so that usage per allocation site is available
+ * without visiting each block.
+ */
+static std::atomic<uint32_t>* hu_stack_buckets = nullptr;
+static std::atomic<hu_stack_entry*> hu_stack_chunks[HU_STACK_MAX_CHUNKS];
+static std::atomic<uint32_t> hu_stack_next_id(HU_STACK_ID_NONE + 1);
+static std::mutex* hu_stack_locks = nullptr;
+
+
+/* ----------- Local Functions ----------------------------------- */
+static inline uint32_t hu_stack_hash(void* const callstack[], int callstack_depth)
+{
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  for (int i = 0; i < callstack_depth; ++i)
+  {
+    hash ^= (uint64_t)(uintptr_t)callstack[i];
+    hash *= 0x100000001b3ULL;
+  }
+
+  return (uint32_t)(hash ^ (hash >> 32));
+}
+
+static inline hu_stack_entry* hu_stack_entry_get(uint32_t id)
+{
+  hu_stack_entry* chunk = hu_stack_chunks[id / HU_STACK_CHUNK_SIZE].load(std::memory_order_acquire);
+  return (chunk != nullptr) ? &chunk[id % HU_STACK_CHUNK_SIZE] : nullptr;
+}
+
+static hu_stack_entry* hu_stack_entry_alloc(uint32_t id)
+{
+  std::atomic<hu_stack_entry*>& slot = hu_stack_chunks[id / HU_STACK_CHUNK_SIZE];
+  hu_stack_entry* chunk = slot.load(std::memory_order_acquire);
+  if (chunk == nullptr)
+  {
+    void* mem = mmap(nullptr, HU_STACK_CHUNK_SIZE * sizeof(hu_stack_entry), PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) return nullptr;
+
+    /* Threads inserting into different buckets may race to create the chunk */
+    if (slot.compare_exchange_strong(chunk, (hu_stack_entry*)mem, std::memory_order_acq_rel))
+    {
+      chunk = (hu_stack_entry*)mem;
+    }
+    else
+    {
+      munmap(mem, HU_STACK_CHUNK_SIZE * sizeof(hu_stack_entry));
+    }
+  }
+
+  return &chunk[id % HU_STACK_CHUNK_SIZE];
+}
+
+static uint32_t hu_stack_find(uint32_t id, uint32_t hash, void* const callstack[], int callstack_depth)
+{
+  while (id != HU_STACK_ID_NONE)
+  {
+    const hu_stack_entry* entry = hu_stack_entry_get(id);
+    if ((entry->hash == hash) && (entry->depth == callstack_depth) &&
+        (memcmp(entry->frames, callstack, callstack_depth * sizeof(void*)) == 0))
+    {
+      return id;
+    }
+
+    id = entry->next;
+  }
+
+  return HU_STACK_ID_NONE;
+}
+
+
+/* ----------- Global Functions ---------------------------------- */
+void hu_stack_init()
+{
+  void* mem = mmap(nullptr, HU_STACK_BUCKETS * sizeof(std::atomic<uint32_t>), PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (mem == MAP_FAILED)
+  {
+    fprintf(stderr, "heapusage error: unable to map stack depot\n");
+    return;
+  }
+
+  hu_stack_locks = new std::mutex[HU_STACK_LOCKS];
+  hu_stack_buckets = (std::atomic<uint32_t>*)mem;
+}
+
+uint32_t hu_stack_intern(void* const callstack[], int callstack_depth)
+{
+  if ((callstack_depth <= 0) || (hu_stack_buckets == nullptr)) return HU_STACK_ID_NONE;
+
+  const uint32_t hash = hu_stack_hash(callstack, callstack_depth);
+  const uint32_t bucket_index = hash & (HU_STACK_BUCKETS - 1);
+  std::atomic<uint32_t>& bucket = hu_stack_buckets[bucket_index];
+
+  uint32_t id = hu_stack_find(bucket.load(std::memory_order_acquire), hash, callstack, callstack_depth);
+  if (id != HU_STACK_ID_NONE) return id;
+
+  std::lock_guard<std::mutex> lock(hu_stack_locks[bucket_index & (HU_STACK_LOCKS - 1)]);
+  id = hu_stack_find(bucket.load(std::memory_order_acquire), hash, callstack, callstack_depth);
+  if (id != HU_STACK_ID_NONE) return id;
+
+  id = hu_stack_next_id.fetch_add(1, std::memory_order_relaxed);
+  if (id >= HU_STACK_MAX_IDS) return HU_STACK_ID_NONE;
+
+  hu_stack_entry* entry = hu_stack_entry_alloc(id);
+  if (entry == nullptr) return HU_STACK_ID_NONE;
+
+  entry->hash = hash;
+  entry->depth = callstack_depth;
+  memcpy(entry->frames, callstack, callstack_depth * sizeof(void*));
+  entry->next = bucket.load(std::memory_order_relaxed);
+  bucket.store(id, std::memory_order_release);
+
+  return id;
+}
+
+uint32_t hu_stack_count()
+{
+  return std::min(hu_stack_next_id.load(std::memory_order_acquire), (uint32_t)HU_STACK_MAX_IDS);
+}
+
+void hu_stack_add_live(uint32_t id, long long bytes, long long blocks)
+{
+  hu_stack_entry* entry = (id != HU_STACK_ID_NONE) ? hu_stack_entry_get(id) : nullptr;
+  if (entry == nullptr) return;
+
+  entry->live_bytes.fetch_add(bytes, std::memory_order_relaxed);
+  entry->live_blocks.fetch_add(blocks, std::memory_order_relaxed);
+}
+
+/* Live counters of a stack, returns false if none are in use or id is not published */
+bool hu_stack_get_live(uint32_t id, unsigned long long* bytes, unsigned long long* blocks)
+{
+  const hu_stack_entry* entry = (id != HU_STACK_ID_NONE) ? hu_stack_entry_get(id) : nullptr;
+  if (entry == nullptr) return false;
+
+  const long long live_bytes = entry->live_bytes.load(std::memory_order_relaxed);
+  const long long live_blocks = entry->live_blocks.load(std::memory_order_relaxed);
+  if ((live_bytes <= 0) || (live_blocks <= 0)) return false;
+
+  *bytes = live_bytes;
+  *blocks = live_blocks;
+  return true;
+}
+
+int hu_stack_get(uint32_t id, void* const** callstack)
+{
+  const hu_stack_entry* entry = (id != HU_STACK_ID_NONE) ? hu_stack_entry_get(id) : nullptr;
+  if (entry == nullptr)
+  {
+    *callstack = nullptr;
+    return 0;
+  }
+
+  *callstack = entry->frames;
+  return entry->depth;
+}
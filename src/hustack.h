@@ -0,0 +1,28 @@
+/*
+ * hustack.h
+ *
+ * Copyright (C) 2026 Kristofer Berggren
+ * All rights reserved.
+ *
+ * heapusage is distributed under the BSD 3-Clause license, see LICENSE for details.
+ *
+ */
+
+#pragma once
+
+/* ----------- Includes ------------------------------------------ */
+#include <cstdint>
+
+
+/* ----------- Defines ------------------------------------------- */
+#define HU_STACK_ID_NONE 0          /* Id of the empty callstack */
+#define HU_STACK_MAX_IDS (1U << 28)  /* Limits number of unique stacks */
+
+
+/* ----------- Global Function Prototypes ------------------------ */
+void hu_stack_init();
+uint32_t hu_stack_intern(void* const callstack[], int callstack_depth);
+int hu_stack_get(uint32_t id, void* const** callstack);
+uint32_t hu_stack_count();
+void hu_stack_add_live(uint32_t id, long long bytes, long long blocks);
+bool hu_stack_get_live(uint32_t id, unsigned long long* bytes, unsigned long long* blocks);
@@ -0,0 +1,451 @@
+/*
+ * husymbolize.cpp
+ *
+ * Copyright (C) 2026 Kristofer Berggren
+ * All rights reserved.
+ *
+ * heapusage is distributed under the BSD 3-Clause license, see LICENSE for details.
+ *
+ */
+
+/* ----------- Includes ------------------------------------------ */
+#include <fcntl.h>
+#include <inttypes.h>
+#include <link.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "backward.hpp"
+
+#if BACKWARD_HAS_DW == 1
+#include <elfutils/libdw.h>
+#endif
+
+
+/* ----------- Types --------------------------------------------- */
+struct hu_sym
+{
+  uintptr_t value;
+  uintptr_t size;
+  std::string name;
+};
+
+/* Function symbols of an object file, sorted by address, and its debug info */
+struct hu_objfile
+{
+  bool loaded = false;
+  std::string build_id;
+  std::vector<hu_sym> syms;
+#if BACKWARD_HAS_DW == 1
+  Dwarf* dwarf = nullptr;
+#endif
+};
+
+/* Module map entry as output by heapusage -n */
+struct hu_module
+{
+  uintptr_t start;
+  uintptr_t end;
+  uintptr_t base;
+  std::string build_id;
+  std::string path;
+};
+
+/* Module map section, found at report line index */
+struct hu_module_map
+{
+  size_t line;
+  std::string prefix;
+  std::vector<hu_module> modules;
+};
+
+
+/* ----------- File Global Variables ----------------------------- */
+static std::map<std::string, hu_objfile> objfiles;
+static std::set<std::string> warned_paths;
+static backward::details::demangler demangler;
+
+
+/* ----------- Local Functions ----------------------------------- */
+static void showusage()
+{
+  std::cout <<
+    "heapusage-symbolize resolves raw addresses in a heapusage report written\n"
+    "with option -n, using the module map at the end of the report.\n"
+    "\n"
+    "Usage: heapusage-symbolize [FILE]\n"
+    "   or: heapusage-symbolize --help\n"
+    "\n"
+    "Options:\n"
+    "   FILE            report to symbolize (default stdin), output to stdout\n"
+    "   -h,--help       display this help and exit\n"
+    "\n"
+    "Example:\n"
+    "heapusage -t leak -n -o report.txt ./ex001 && heapusage-symbolize report.txt\n"
+    "   analyze heap for memory leaks, and symbolize the report afterwards.\n"
+    "\n"
+    "Report bugs at https://github.com/d99kris/heapusage\n"
+    "\n";
+}
+
+static std::string hu_get_build_id(const char* data, size_t len, const ElfW(Shdr)& shdr)
+{
+  static const char hex[] = "0123456789abcdef";
+  if ((shdr.sh_offset + shdr.sh_size) > len) return std::string();
+
+  const char* note = data + shdr.sh_offset;
+  const char* note_end = note + shdr.sh_size;
+  while ((note + sizeof(ElfW(Nhdr))) <= note_end)
+  {
+    const ElfW(Nhdr)* nhdr = (const ElfW(Nhdr)*)note;
+    const char* name = note + sizeof(ElfW(Nhdr));
+    const unsigned char* desc = (const unsigned char*)(name + ((nhdr->n_namesz + 3) & ~3U));
+    if (((const char*)desc + nhdr->n_descsz) > note_end) break;
+
+    if ((nhdr->n_type == NT_GNU_BUILD_ID) && (nhdr->n_namesz == 4) && (memcmp(name, "GNU", 4) == 0))
+    {
+      std::string build_id;
+      for (size_t i = 0; i < nhdr->n_descsz; ++i)
+      {
+        build_id += hex[desc[i] >> 4];
+        build_id += hex[desc[i] & 0xf];
+      }
+
+      return build_id;
+    }
+
+    note = (const char*)desc + ((nhdr->n_descsz + 3) & ~3U);
+  }
+
+  return std::string();
+}
+
+/*
+ * Load function symbols from .symtab, or from .dynsym if the object file is
+ * stripped, along with its GNU build-id and DWARF debug info if present.
+ */
+static void hu_load_objfile(const std::string& path, hu_objfile& objfile)
+{
+  objfile.loaded = true;
+
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd == -1) return;
+
+  struct stat st;
+  if ((fstat(fd, &st) != 0) || ((size_t)st.st_size < sizeof(ElfW(Ehdr))))
+  {
+    close(fd);
+    return;
+  }
+
+  const size_t len = st.st_size;
+  void* mem = mmap(nullptr, len, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (mem == MAP_FAILED)
+  {
+    close(fd);
+    return;
+  }
+
+#if BACKWARD_HAS_DW == 1
+  /* Debug info is read on demand, so the descriptor is kept open with it */
+  objfile.dwarf = dwarf_begin(fd, DWARF_C_READ);
+  if (objfile.dwarf == nullptr)
+  {
+    close(fd);
+  }
+#else
+  close(fd);
+#endif
+
+  const char* data = (const char*)mem;
+  const ElfW(Ehdr)* ehdr = (const ElfW(Ehdr)*)data;
+  if ((memcmp(ehdr->e_ident, ELFMAG, SELFMAG) != 0) || (ehdr->e_ident[EI_CLASS] != ELFCLASS64 - (sizeof(void*) == 4)) ||
+      (ehdr->e_shentsize != sizeof(ElfW(Shdr))) || ((ehdr->e_shoff + ehdr->e_shnum * sizeof(ElfW(Shdr))) > len))
+  {
+    munmap(mem, len);
+    return;
+  }
+
+  const ElfW(Shdr)* shdrs = (const ElfW(Shdr)*)(data + ehdr->e_shoff);
+  const ElfW(Shdr)* symtab = nullptr;
+  const ElfW(Shdr)* dynsym = nullptr;
+  for (int i = 0; i < ehdr->e_shnum; ++i)
+  {
+    if (shdrs[i].sh_type == SHT_SYMTAB)
+    {
+      symtab = &shdrs[i];
+    }
+    else if (shdrs[i].sh_type == SHT_DYNSYM)
+    {
+      dynsym = &shdrs[i];
+    }
+    else if ((shdrs[i].sh_type == SHT_NOTE) && objfile.build_id.empty())
+    {
+      objfile.build_id = hu_get_build_id(data, len, shdrs[i]);
+    }
+  }
+
+  const ElfW(Shdr)* syms = (symtab != nullptr) ? symtab : dynsym;
+  if ((syms != nullptr) && (syms->sh_link < ehdr->e_shnum) && ((syms->sh_offset + syms->sh_size) <= len))
+  {
+    const ElfW(Shdr)& strtab = shdrs[syms->sh_link];
+    const ElfW(Sym)* sym = (const ElfW(Sym)*)(data + syms->sh_offset);
+    const size_t count = syms->sh_size / sizeof(ElfW(Sym));
+    for (size_t i = 0; i < count; ++i)
+    {
+      if ((ELF64_ST_TYPE(sym[i].st_info) != STT_FUNC) || (sym[i].st_value == 0) ||
+          (sym[i].st_name >= strtab.sh_size) || ((strtab.sh_offset + strtab.sh_size) > len))
+      {
+        continue;
+      }
+
+      hu_sym entry;
+      entry.value = sym[i].st_value;
+      entry.size = sym[i].st_size;
+      entry.name = std::string(data + strtab.sh_offset + sym[i].st_name);
+      objfile.syms.push_back(entry);
+    }
+  }
+
+  munmap(mem, len);
+
+  std::sort(objfile.syms.begin(), objfile.syms.end(),
+            [](const hu_sym& lhs, const hu_sym& rhs) { return lhs.value < rhs.value; });
+}
+
+#if BACKWARD_HAS_DW == 1
+/*
+ * Source file and line of an object file address from its DWARF line table,
+ * in the same form as symbols resolved at run time.
+ */
+static std::string hu_resolve_line(hu_objfile& objfile, uintptr_t vaddr)
+{
+  if (objfile.dwarf == nullptr) return std::string();
+
+  Dwarf_Die cudie;
+  Dwarf_Die* die = dwarf_addrdie(objfile.dwarf, vaddr, &cudie);
+  if (die == nullptr)
+  {
+    /* Object files without .debug_aranges need a search of compile units */
+    Dwarf_Off offset = 0;
+    Dwarf_Off next_offset = 0;
+    size_t header_size = 0;
+    while (dwarf_nextcu(objfile.dwarf, offset, &next_offset, &header_size, nullptr, nullptr, nullptr) == 0)
+    {
+      if ((dwarf_offdie(objfile.dwarf, offset + header_size, &cudie) != nullptr) &&
+          (dwarf_haspc(&cudie, vaddr) == 1))
+      {
+        die = &cudie;
+        break;
+      }
+
+      offset = next_offset;
+    }
+  }
+
+  if (die == nullptr) return std::string();
+
+  Dwarf_Line* line = dwarf_getsrc_die(die, vaddr);
+  if (line == nullptr) return std::string();
+
+  const char* path = dwarf_linesrc(line, nullptr, nullptr);
+  int lineno = 0;
+  if ((path == nullptr) || (dwarf_lineno(line, &lineno) != 0)) return std::string();
+
+  const char* filename = strrchr(path, '/');
+  return std::string((filename != nullptr) ? (filename + 1) : path) + ":" + std::to_string(lineno);
+}
+#endif
+
+static std::string hu_resolve(const hu_module& module, uintptr_t addr)
+{
+  hu_objfile& objfile = objfiles[module.path];
+  if (!objfile.loaded)
+  {
+    hu_load_objfile(module.path, objfile);
+  }
+
+  /* Symbols from a different build would be misleading */
+  if ((module.build_id != "-") && !objfile.build_id.empty() && (module.build_id != objfile.build_id))
+  {
+    if (warned_paths.insert(module.path).second)
+    {
+      std::cerr << "heapusage-symbolize: build-id mismatch for " << module.path << "\n";
+    }
+
+    return std::string();
+  }
+
+  const uintptr_t vaddr = addr - module.base;
+  auto it = std::upper_bound(objfile.syms.begin(), objfile.syms.end(), vaddr,
+                             [](uintptr_t value, const hu_sym& sym) { return value < sym.value; });
+  if (it == objfile.syms.begin()) return std::string();
+
+  --it;
+  if ((it->size != 0) && (vaddr > (it->value + it->size))) return std::string();
+
+  std::string symbol = demangler.demangle(it->name.c_str()) + " + " + std::to_string(vaddr - it->value);
+#if BACKWARD_HAS_DW == 1
+  /* Frames are return addresses, so look up the line of the call before it */
+  const std::string source = hu_resolve_line(objfile, vaddr - 1);
+  if (!source.empty())
+  {
+    symbol += " (" + source + ")";
+  }
+#endif
+
+  return symbol;
+}
+
+static bool hu_parse_module(const std::string& text, hu_module& module)
+{
+  char build_id[128] = { 0 };
+  int path_pos = 0;
+  if (sscanf(text.c_str(), " 0x%" SCNxPTR "-0x%" SCNxPTR " 0x%" SCNxPTR " %127s %n",
+             &module.start, &module.end, &module.base, build_id, &path_pos) != 4) return false;
+
+  if (path_pos == 0) return false;
+
+  module.build_id = build_id;
+  module.path = text.substr(path_pos);
+  return true;
+}
+
+/*
+ * Split a report line into its prefix (empty, or "==pid== ") and the text
+ * following it.
+ */
+static void hu_split_prefix(const std::string& line, std::string& prefix, std::string& text)
+{
+  size_t pos = 0;
+  if ((line.compare(0, 2, "==") == 0) && ((pos = line.find("== ", 2)) != std::string::npos))
+  {
+    pos += 3;
+  }
+  else
+  {
+    pos = 0;
+  }
+
+  prefix = line.substr(0, pos);
+  text = line.substr(pos);
+}
+
+
+/* ----------- Global Functions ---------------------------------- */
+int main(int argc, char* argv[])
+{
+  if ((argc > 1) && ((strcmp(argv[1], "-h") == 0) || (strcmp(argv[1], "--help") == 0)))
+  {
+    showusage();
+    return 0;
+  }
+
+  std::vector<std::string> lines;
+  std::string line;
+  if (argc > 1)
+  {
+    std::ifstream file(argv[1]);
+    if (!file.is_open())
+    {
+      std::cerr << "heapusage-symbolize: unable to open " << argv[1] << "\n";
+      return 1;
+    }
+
+    while (std::getline(file, line))
+    {
+      lines.push_back(line);
+    }
+  }
+  else
+  {
+    while (std::getline(std::cin, line))
+    {
+      lines.push_back(line);
+    }
+  }
+
+  /* Each report ends with the module map of the process that wrote it */
+  std::vector<hu_module_map> maps;
+  for (size_t i = 0; i < lines.size(); ++i)
+  {
+    std::string prefix;
+    std::string text;
+    hu_split_prefix(lines[i], prefix, text);
+    if (text != "MODULE MAP:") continue;
+
+    hu_module_map map;
+    map.line = i;
+    map.prefix = prefix;
+    hu_module module;
+    while (((i + 1) < lines.size()) && (lines[i + 1].compare(0, prefix.size(), prefix) == 0) &&
+           hu_parse_module(lines[i + 1].substr(prefix.size()), module))
+    {
+      map.modules.push_back(module);
+      ++i;
+    }
+
+    maps.push_back(map);
+  }
+
+  if (maps.empty())
+  {
+    std::cerr << "heapusage-symbolize: no module map found, report must be written with -n\n";
+  }
+
+  for (size_t i = 0; i < lines.size(); ++i)
+  {
+    std::string prefix;
+    std::string text;
+    hu_split_prefix(lines[i], prefix, text);
+
+    uintptr_t addr = 0;
+    int end_pos = 0;
+    if ((sscanf(text.c_str(), "   at 0x%" SCNxPTR "%n", &addr, &end_pos) != 1) ||
+        ((size_t)end_pos != text.size()))
+    {
+      std::cout << lines[i] << "\n";
+      continue;
+    }
+
+    /* Use first module map following the frame, from the same process */
+    const hu_module_map* map = nullptr;
+    for (const hu_module_map& candidate : maps)
+    {
+      if (candidate.prefix != prefix) continue;
+
+      map = &candidate;
+      if (candidate.line > i) break;
+    }
+
+    std::string symbol;
+    if (map != nullptr)
+    {
+      for (const hu_module& module : map->modules)
+      {
+        if ((addr >= module.start) && (addr < module.end))
+        {
+          symbol = hu_resolve(module, addr);
+          break;
+        }
+      }
+    }
+
+    std::cout << lines[i] << ": " << (symbol.empty() ? "???" : symbol) << "\n";
+  }
+
+  return 0;
+}
@@ -0,0 +1,296 @@
+/*
+ * hutable.h
+ *
+ * Copyright (C) 2026 Kristofer Berggren
+ * All rights reserved.
+ *
+ * heapusage is distributed under the BSD 3-Clause license, see LICENSE for details.
+ *
+ */
+
+#pragma once
+
+/* ----------- Includes ------------------------------------------ */
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+
+#include <sys/mman.h>
+
+
+/* ----------- Defines ------------------------------------------- */
+#define HU_TABLE_MIN_CAPACITY 1024   /* Initial number of slots, must be power of two */
+#define HU_TABLE_MIGRATE_STEP 16     /* Old slots moved per update during resize */
+
+
+/* ----------- Types --------------------------------------------- */
+/*
+ * hu_table is a flat open-addressing hash table keyed by heap pointer, with
+ * linear probing and tombstones for erased entries. Slot arrays are mapped
+ * directly with mmap(), so the table never calls the interposed allocator.
+ *
+ * Growing is incremental: when the load limit is reached a new slot array is
+ * mapped and the previous one is kept alongside it, and each following
+ * insert or erase moves a few old slots over. Lookups consult both arrays
+ * until the migration completes and the old array is unmapped. The new array
+ * is sized so that migration always finishes before it reaches its own limit.
+ *
+ * Values must be trivially copyable. Not thread-safe; callers lock.
+ */
+template <typename T>
+class hu_table
+{
+public:
+  hu_table()
+  {
+  }
+
+  ~hu_table()
+  {
+    hu_table_unmap(m_cur);
+    hu_table_unmap(m_old);
+  }
+
+  hu_table(const hu_table&) = delete;
+  hu_table& operator=(const hu_table&) = delete;
+
+  size_t size() const
+  {
+    return m_count;
+  }
+
+  T* find(const void* key)
+  {
+    hu_table_slot* slot = hu_table_lookup(m_cur, key);
+    if ((slot == nullptr) && (m_old.slots != nullptr))
+    {
+      slot = hu_table_lookup(m_old, key);
+    }
+
+    return (slot != nullptr) ? &slot->value : nullptr;
+  }
+
+  bool contains(const void* key)
+  {
+    return find(key) != nullptr;
+  }
+
+  /* Insert or overwrite, returns false if slot memory could not be mapped */
+  bool insert(const void* key, const T& value)
+  {
+    if ((key == nullptr) || ((uintptr_t)key == HU_TABLE_TOMBSTONE)) return false;
+
+    hu_table_step();
+
+    hu_table_slot* slot = hu_table_lookup(m_cur, key);
+    if (slot != nullptr)
+    {
+      slot->value = value;
+      return true;
+    }
+
+    /* Entry not yet migrated is moved over, keeping a key in one array only */
+    if ((m_old.slots != nullptr) && hu_table_remove(m_old, key, nullptr))
+    {
+      --m_count;
+    }
+
+    if (((m_cur.used + 1) * 2) > m_cur.capacity)
+    {
+      if (!hu_table_grow()) return false;
+    }
+
+    hu_table_place(m_cur, key, value);
+    ++m_count;
+    return true;
+  }
+
+  /* Erase entry, optionally returning its value */
+  bool erase(const void* key, T* value = nullptr)
+  {
+    hu_table_step();
+
+    bool erased = hu_table_remove(m_cur, key, value);
+    if (!erased && (m_old.slots != nullptr))
+    {
+      erased = hu_table_remove(m_old, key, value);
+    }
+
+    if (erased)
+    {
+      --m_count;
+    }
+
+    return erased;
+  }
+
+private:
+  struct hu_table_slot
+  {
+    uintptr_t key;
+    T value;
+  };
+
+  struct hu_table_array
+  {
+    hu_table_slot* slots = nullptr;
+    size_t capacity = 0;
+    size_t used = 0;   /* Live entries and tombstones */
+    int shift = 0;
+  };
+
+  static const uintptr_t HU_TABLE_EMPTY = 0;
+  static const uintptr_t HU_TABLE_TOMBSTONE = UINTPTR_MAX;
+
+  static inline size_t hu_table_hash(const hu_table_array& array, uintptr_t key)
+  {
+    /*
+     * Keys of a table share their shard index, a multiplicative hash of the
+     * same address, so a different mixer (murmur3 finalizer) is used here to
+     * keep slots from correlating with the shard. Top bits index the array.
+     */
+    uint64_t hash = (uint64_t)key;
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ULL;
+    hash ^= hash >> 33;
+    return (size_t)(hash >> array.shift);
+  }
+
+  static bool hu_table_map(hu_table_array& array, size_t capacity)
+  {
+    void* mem = mmap(nullptr, capacity * sizeof(hu_table_slot), PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) return false;
+
+    /* Anonymous mappings are zero-filled, i.e. all slots HU_TABLE_EMPTY */
+    array.slots = (hu_table_slot*)mem;
+    array.capacity = capacity;
+    array.used = 0;
+    array.shift = 64;
+    for (size_t i = capacity; i > 1; i >>= 1)
+    {
+      --array.shift;
+    }
+
+    return true;
+  }
+
+  static void hu_table_unmap(hu_table_array& array)
+  {
+    if (array.slots != nullptr)
+    {
+      munmap(array.slots, array.capacity * sizeof(hu_table_slot));
+      array = hu_table_array();
+    }
+  }
+
+  static hu_table_slot* hu_table_lookup(hu_table_array& array, const void* ptr)
+  {
+    const uintptr_t key = (uintptr_t)ptr;
+    if ((array.slots == nullptr) || (key == HU_TABLE_EMPTY) || (key == HU_TABLE_TOMBSTONE)) return nullptr;
+
+    const size_t mask = array.capacity - 1;
+    for (size_t i = hu_table_hash(array, key); ; i = (i + 1) & mask)
+    {
+      hu_table_slot* slot = &array.slots[i];
+      if (slot->key == key) return slot;
+      if (slot->key == HU_TABLE_EMPTY) return nullptr;
+    }
+  }
+
+  static void hu_table_place(hu_table_array& array, const void* ptr, const T& value)
+  {
+    const uintptr_t key = (uintptr_t)ptr;
+    const size_t mask = array.capacity - 1;
+    for (size_t i = hu_table_hash(array, key); ; i = (i + 1) & mask)
+    {
+      hu_table_slot* slot = &array.slots[i];
+      if (slot->key == HU_TABLE_TOMBSTONE)
+      {
+        slot->key = key;
+        slot->value = value;
+        return;
+      }
+
+      if (slot->key == HU_TABLE_EMPTY)
+      {
+        slot->key = key;
+        slot->value = value;
+        ++array.used;
+        return;
+      }
+    }
+  }
+
+  static bool hu_table_remove(hu_table_array& array, const void* ptr, T* value)
+  {
+    hu_table_slot* slot = hu_table_lookup(array, ptr);
+    if (slot == nullptr) return false;
+
+    if (value != nullptr)
+    {
+      *value = slot->value;
+    }
+
+    slot->key = HU_TABLE_TOMBSTONE;
+    return true;
+  }
+
+  /*
+   * Start a resize. The new array is twice the size, unless most used slots
+   * are tombstones, in which case it is rebuilt at the same size. Either way
+   * at least a quarter of its slots remain free once all live entries are
+   * moved, which covers the capacity / HU_TABLE_MIGRATE_STEP updates needed
+   * to complete the migration.
+   */
+  bool hu_table_grow()
+  {
+    if (m_cur.slots == nullptr)
+    {
+      return hu_table_map(m_cur, HU_TABLE_MIN_CAPACITY);
+    }
+
+    /* Not expected, but never keep more than one old array */
+    while (m_old.slots != nullptr)
+    {
+      hu_table_step();
+    }
+
+    const size_t capacity = ((m_count * 4) > m_cur.capacity) ? (m_cur.capacity * 2) : m_cur.capacity;
+    hu_table_array array;
+    if (!hu_table_map(array, capacity)) return false;
+
+    m_old = m_cur;
+    m_cur = array;
+    m_migrate_pos = 0;
+    return true;
+  }
+
+  void hu_table_step()
+  {
+    if (m_old.slots == nullptr) return;
+
+    const size_t end = std::min(m_migrate_pos + HU_TABLE_MIGRATE_STEP, m_old.capacity);
+    for (; m_migrate_pos < end; ++m_migrate_pos)
+    {
+      hu_table_slot* slot = &m_old.slots[m_migrate_pos];
+      if ((slot->key != HU_TABLE_EMPTY) && (slot->key != HU_TABLE_TOMBSTONE))
+      {
+        hu_table_place(m_cur, (void*)slot->key, slot->value);
+        slot->key = HU_TABLE_TOMBSTONE;
+      }
+    }
+
+    if (m_migrate_pos == m_old.capacity)
+    {
+      hu_table_unmap(m_old);
+    }
+  }
+
+  hu_table_array m_cur;
+  hu_table_array m_old;
+  size_t m_migrate_pos = 0;
+  size_t m_count = 0;
+};
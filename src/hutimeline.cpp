@@ -0,0 +1,225 @@
+/*
+ * hutimeline.cpp
+ *
+ * Copyright (C) 2026 Kristofer Berggren
+ * All rights reserved.
+ *
+ * heapusage is distributed under the BSD 3-Clause license, see LICENSE for details.
+ *
+ */
+
+/* ----------- Includes ------------------------------------------ */
+#ifndef __STDC_FORMAT_MACROS
+#define __STDC_FORMAT_MACROS
+#endif
+
+#include <algorithm>
+#include <cerrno>
+#include <cinttypes>
+#include <cstdarg>
+#include <cstdio>
+#include <mutex>
+#include <set>
+
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+
+#include "hustack.h"
+#include "hutimeline.h"
+
+
+/* ----------- Defines ------------------------------------------- */
+#define HU_TIMELINE_LINE_MAX 4096   /* Longest line written */
+
+
+/* ----------- File Global Variables ----------------------------- */
+/*
+ * Snapshots are kept in a fixed array mapped at init, oldest first. When it
+ * is full, the older half is coalesced by keeping only the snapshot with the
+ * most heap bytes of each adjacent pair, so that resolution decreases with
+ * age while peaks are retained, and memory use stays constant however long
+ * the process runs.
+ */
+static int hu_timeline_fd = -1;
+static std::mutex* hu_timeline_mutex = nullptr;
+static hu_timeline_snapshot_t* hu_timeline_snapshots = nullptr;
+static size_t hu_timeline_capacity = 0;
+static size_t hu_timeline_count = 0;
+static unsigned long long hu_timeline_coalesced = 0;
+static unsigned long long hu_timeline_start_ms = 0;
+
+
+/* ----------- Local Functions ----------------------------------- */
+static unsigned long long hu_timeline_clock_ms()
+{
+  struct timespec ts;
+#if defined(CLOCK_MONOTONIC_COARSE)
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+#else
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+  return ((unsigned long long)ts.tv_sec * 1000ULL) + ((unsigned long long)ts.tv_nsec / 1000000ULL);
+}
+
+static void hu_timeline_coalesce()
+{
+  const size_t half = (hu_timeline_count / 2) & ~(size_t)1;
+  for (size_t i = 0; i < half; i += 2)
+  {
+    const hu_timeline_snapshot_t& lhs = hu_timeline_snapshots[i];
+    const hu_timeline_snapshot_t& rhs = hu_timeline_snapshots[i + 1];
+    hu_timeline_snapshots[i / 2] = (lhs.heap_bytes > rhs.heap_bytes) ? lhs : rhs;
+  }
+
+  std::copy(hu_timeline_snapshots + half, hu_timeline_snapshots + hu_timeline_count,
+            hu_timeline_snapshots + (half / 2));
+  hu_timeline_count -= half / 2;
+  hu_timeline_coalesced += half / 2;
+}
+
+static void hu_timeline_write_line(const char* format, ...) __attribute__ ((format (printf, 1, 2)));
+
+static void hu_timeline_write_line(const char* format, ...)
+{
+  char line[HU_TIMELINE_LINE_MAX];
+  va_list args;
+  va_start(args, format);
+  int len = vsnprintf(line, sizeof(line), format, args);
+  va_end(args);
+  if (len < 0) return;
+
+  const char* data = line;
+  size_t remaining = std::min((size_t)len, sizeof(line) - 1);
+  while (remaining > 0)
+  {
+    ssize_t rv = write(hu_timeline_fd, data, remaining);
+    if (rv < 0)
+    {
+      if (errno == EINTR) continue;
+
+      return;
+    }
+
+    data += rv;
+    remaining -= rv;
+  }
+}
+
+
+/* ----------- Global Functions ---------------------------------- */
+bool hu_timeline_init(const char* path, size_t max_snapshots)
+{
+  hu_timeline_capacity = std::max(max_snapshots, (size_t)HU_TIMELINE_MIN_SNAPSHOTS);
+  void* mem = mmap(nullptr, hu_timeline_capacity * sizeof(hu_timeline_snapshot_t), PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (mem == MAP_FAILED) return false;
+
+  hu_timeline_snapshots = (hu_timeline_snapshot_t*)mem;
+  hu_timeline_mutex = new std::mutex();
+  hu_timeline_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (hu_timeline_fd == -1) return false;
+
+  hu_timeline_start_ms = hu_timeline_clock_ms();
+  return true;
+}
+
+unsigned long long hu_timeline_time_ms()
+{
+  return hu_timeline_clock_ms() - hu_timeline_start_ms;
+}
+
+void hu_timeline_add(const hu_timeline_snapshot_t& snapshot)
+{
+  std::lock_guard<std::mutex> lock(*hu_timeline_mutex);
+  if (hu_timeline_count == hu_timeline_capacity)
+  {
+    hu_timeline_coalesce();
+  }
+
+  hu_timeline_snapshots[hu_timeline_count++] = snapshot;
+}
+
+/* Call sites referenced by any snapshot kept */
+std::vector<uint32_t> hu_timeline_site_ids()
+{
+  std::lock_guard<std::mutex> lock(*hu_timeline_mutex);
+  std::set<uint32_t> ids;
+  for (size_t i = 0; i < hu_timeline_count; ++i)
+  {
+    for (size_t j = 0; j < hu_timeline_snapshots[i].site_count; ++j)
+    {
+      ids.insert(hu_timeline_snapshots[i].sites[j].callstack_id);
+    }
+  }
+
+  return std::vector<uint32_t>(ids.begin(), ids.end());
+}
+
+/*
+ * hu_timeline_write writes out the series, with call stacks of the sites
+ * symbolized by symbolizer, or as raw addresses if it is nullptr. The file is
+ * rewritten in full, so it is valid if written again later.
+ */
+void hu_timeline_write(const char* command, hu_timeline_symbolizer_t symbolizer)
+{
+  const std::vector<uint32_t> site_ids = hu_timeline_site_ids();
+
+  std::lock_guard<std::mutex> lock(*hu_timeline_mutex);
+  if ((ftruncate(hu_timeline_fd, 0) != 0) || (lseek(hu_timeline_fd, 0, SEEK_SET) != 0)) return;
+
+  hu_timeline_write_line("# heapusage timeline\n");
+  hu_timeline_write_line("# command: %s\n", (command != nullptr) ? command : "");
+  hu_timeline_write_line("# snapshots: %zu (%llu coalesced)\n", hu_timeline_count, hu_timeline_coalesced);
+  hu_timeline_write_line("# snapshot TIME_MS ALLOCATED HEAP_BYTES HEAP_BLOCKS [SITE:BYTES:BLOCKS ...]\n");
+  for (size_t i = 0; i < hu_timeline_count; ++i)
+  {
+    const hu_timeline_snapshot_t& snapshot = hu_timeline_snapshots[i];
+    char line[HU_TIMELINE_LINE_MAX];
+    int len = snprintf(line, sizeof(line), "snapshot %llu %llu %llu %llu", snapshot.time_ms,
+                       snapshot.alloc_bytes, snapshot.heap_bytes, snapshot.heap_blocks);
+    for (size_t j = 0; (j < snapshot.site_count) && (len > 0) && ((size_t)len < sizeof(line)); ++j)
+    {
+      len += snprintf(line + len, sizeof(line) - len, " %" PRIu32 ":%llu:%llu", snapshot.sites[j].callstack_id,
+                      snapshot.sites[j].bytes, snapshot.sites[j].blocks);
+    }
+
+    hu_timeline_write_line("%s\n", line);
+  }
+
+  for (uint32_t site_id : site_ids)
+  {
+    hu_timeline_write_line("site %" PRIu32 "\n", site_id);
+
+    /* First frame is the allocator wrapper */
+    void* const* callstack = nullptr;
+    int callstack_depth = hu_stack_get(site_id, &callstack);
+    for (int i = 1; i < callstack_depth; ++i)
+    {
+      if (symbolizer == nullptr)
+      {
+        hu_timeline_write_line("   at 0x%016" PRIxPTR "\n", (uintptr_t)callstack[i]);
+      }
+      else
+      {
+        std::string symbol = symbolizer(callstack[i]);
+        hu_timeline_write_line("   at 0x%016" PRIxPTR ": %s\n", (uintptr_t)callstack[i],
+                               symbol.empty() ? "???" : symbol.c_str());
+      }
+    }
+  }
+}
+
+size_t hu_timeline_snapshot_count()
+{
+  std::lock_guard<std::mutex> lock(*hu_timeline_mutex);
+  return hu_timeline_count;
+}
+
+unsigned long long hu_timeline_coalesced_count()
+{
+  std::lock_guard<std::mutex> lock(*hu_timeline_mutex);
+  return hu_timeline_coalesced;
+}
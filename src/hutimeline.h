@@ -0,0 +1,66 @@
+/*
+ * hutimeline.h
+ *
+ * Copyright (C) 2026 Kristofer Berggren
+ * All rights reserved.
+ *
+ * heapusage is distributed under the BSD 3-Clause license, see LICENSE for details.
+ *
+ */
+
+#pragma once
+
+/* ----------- Includes ------------------------------------------ */
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+
+/* ----------- Defines ------------------------------------------- */
+#define HU_TIMELINE_MAX_SITES 32       /* Top call sites kept per snapshot */
+#define HU_TIMELINE_MIN_SNAPSHOTS 8    /* Smallest snapshot series kept */
+
+/*
+ * Timeline file format. Text, starting with a header of lines beginning
+ * with '#', followed by one line per snapshot, oldest first:
+ *   snapshot TIME_MS ALLOCATED HEAP_BYTES HEAP_BLOCKS [SITE:BYTES:BLOCKS ...]
+ * where ALLOCATED is the total number of bytes allocated so far, and sites
+ * are the call sites holding the most heap bytes, largest first. The call
+ * stack of each site referenced is listed once at the end of the file:
+ *   site SITE
+ *      at 0x...: symbol
+ */
+
+
+/* ----------- Types --------------------------------------------- */
+typedef struct hu_timeline_site_s
+{
+  uint32_t callstack_id;
+  unsigned long long bytes;
+  unsigned long long blocks;
+}
+hu_timeline_site_t;
+
+typedef struct hu_timeline_snapshot_s
+{
+  unsigned long long time_ms;       /* Since start of process */
+  unsigned long long alloc_bytes;   /* Total bytes allocated */
+  unsigned long long heap_bytes;
+  unsigned long long heap_blocks;
+  size_t site_count;
+  hu_timeline_site_t sites[HU_TIMELINE_MAX_SITES];
+}
+hu_timeline_snapshot_t;
+
+typedef std::string (*hu_timeline_symbolizer_t)(void* addr);
+
+
+/* ----------- Global Function Prototypes ------------------------ */
+bool hu_timeline_init(const char* path, size_t max_snapshots);
+unsigned long long hu_timeline_time_ms();
+void hu_timeline_add(const hu_timeline_snapshot_t& snapshot);
+std::vector<uint32_t> hu_timeline_site_ids();
+void hu_timeline_write(const char* command, hu_timeline_symbolizer_t symbolizer);
+size_t hu_timeline_snapshot_count();
+unsigned long long hu_timeline_coalesced_count();
@@ -0,0 +1,291 @@
+/*
+ * hutrace.cpp
+ *
+ * Copyright (C) 2026 Kristofer Berggren
+ * All rights reserved.
+ *
+ * heapusage is distributed under the BSD 3-Clause license, see LICENSE for details.
+ *
+ */
+
+/* ----------- Includes ------------------------------------------ */
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <mutex>
+#include <new>
+
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+
+#include "hulog.h"
+#include "hustack.h"
+#include "hutrace.h"
+
+
+/* ----------- Defines ------------------------------------------- */
+#define HU_TRACE_BUFFER_SIZE (256 * 1024)                        /* Bytes buffered per thread */
+#define HU_TRACE_RECORD_MAX (64 + ((MAX_CALL_STACK + 4) * 10))   /* Stack and event record */
+#define HU_TRACE_MODULE_MAX 4096                                 /* Module record */
+
+
+/* ----------- Types --------------------------------------------- */
+/*
+ * hu_trace_buffer holds encoded records of one application thread at a time.
+ * Buffers are never unmapped; when the owning thread exits its records are
+ * written out and the buffer is released for reuse by a later thread, under
+ * a new thread number. The mutex is only contended when flushing all buffers.
+ */
+struct hu_trace_buffer
+{
+  std::mutex mutex;
+  std::atomic<bool> in_use;
+  hu_trace_buffer* next;
+  uint32_t thread;
+  uint64_t last_time;
+  size_t len;
+  unsigned char data[HU_TRACE_BUFFER_SIZE];
+};
+
+struct hu_trace_buffer_owner
+{
+  hu_trace_buffer* buffer = nullptr;
+
+  ~hu_trace_buffer_owner();
+};
+
+
+/* ----------- File Global Variables ----------------------------- */
+static int hu_trace_fd = -1;
+static pid_t hu_trace_pid = 0;
+static uint64_t hu_trace_start_time = 0;
+static std::mutex* hu_trace_write_mutex = nullptr;
+static std::atomic<hu_trace_buffer*> hu_trace_buffers(nullptr);
+static std::atomic<uint32_t> hu_trace_next_thread(0);
+static std::atomic<unsigned long long> hu_trace_events(0);
+static thread_local hu_trace_buffer_owner hu_trace_owner;
+
+/* Bitmap of stack ids written to the trace */
+static std::atomic<uint64_t>* hu_trace_stacks_written = nullptr;
+
+
+/* ----------- Local Functions ----------------------------------- */
+static inline uint64_t hu_trace_time()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((uint64_t)ts.tv_sec * 1000000000ULL) + ts.tv_nsec;
+}
+
+static inline unsigned char* hu_trace_put(unsigned char* out, uint64_t value)
+{
+  while (value >= 0x80)
+  {
+    *out++ = (unsigned char)(value | 0x80);
+    value >>= 7;
+  }
+
+  *out++ = (unsigned char)value;
+  return out;
+}
+
+static void hu_trace_write(const unsigned char* data, size_t len)
+{
+  /* Records of forked children would duplicate those of the parent */
+  if ((hu_trace_fd == -1) || (getpid() != hu_trace_pid)) return;
+
+  /* Serialized, so each block is written contiguously */
+  std::lock_guard<std::mutex> lock(*hu_trace_write_mutex);
+  while (len > 0)
+  {
+    ssize_t rv = write(hu_trace_fd, data, len);
+    if (rv < 0)
+    {
+      if (errno == EINTR) continue;
+
+      return;
+    }
+
+    data += rv;
+    len -= rv;
+  }
+}
+
+/* Caller must hold buffer mutex */
+static void hu_trace_buffer_flush(hu_trace_buffer* buffer)
+{
+  if (buffer->len > 0)
+  {
+    hu_trace_write(buffer->data, buffer->len);
+    buffer->len = 0;
+  }
+}
+
+static hu_trace_buffer* hu_trace_buffer_acquire()
+{
+  hu_trace_buffer* buffer = nullptr;
+
+  /* Reuse a buffer released by an exited thread */
+  for (hu_trace_buffer* it = hu_trace_buffers.load(std::memory_order_acquire); it != nullptr; it = it->next)
+  {
+    bool expected = false;
+    if (!it->in_use.load(std::memory_order_relaxed) &&
+        it->in_use.compare_exchange_strong(expected, true, std::memory_order_acquire))
+    {
+      buffer = it;
+      break;
+    }
+  }
+
+  /* Otherwise map a new one, outside of the interposed allocator */
+  if (buffer == nullptr)
+  {
+    void* mem = mmap(nullptr, sizeof(hu_trace_buffer), PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) return nullptr;
+
+    buffer = new (mem) hu_trace_buffer();
+    buffer->in_use.store(true, std::memory_order_relaxed);
+    buffer->len = 0;
+    buffer->next = hu_trace_buffers.load(std::memory_order_relaxed);
+    while (!hu_trace_buffers.compare_exchange_weak(buffer->next, buffer, std::memory_order_release,
+                                                   std::memory_order_relaxed))
+    {
+    }
+  }
+
+  std::lock_guard<std::mutex> lock(buffer->mutex);
+  buffer->thread = hu_trace_next_thread.fetch_add(1, std::memory_order_relaxed);
+  buffer->last_time = hu_trace_start_time;
+  return buffer;
+}
+
+hu_trace_buffer_owner::~hu_trace_buffer_owner()
+{
+  if (buffer != nullptr)
+  {
+    {
+      std::lock_guard<std::mutex> lock(buffer->mutex);
+      hu_trace_buffer_flush(buffer);
+    }
+
+    buffer->in_use.store(false, std::memory_order_release);
+  }
+}
+
+/* Returns true for the first caller with a given stack id */
+static inline bool hu_trace_stack_claim(uint32_t id)
+{
+  const uint64_t bit = 1ULL << (id % 64);
+  std::atomic<uint64_t>& word = hu_trace_stacks_written[id / 64];
+  if (word.load(std::memory_order_relaxed) & bit) return false;
+
+  return !(word.fetch_or(bit, std::memory_order_relaxed) & bit);
+}
+
+
+/* ----------- Global Functions ---------------------------------- */
+bool hu_trace_init(const char* path)
+{
+  void* mem = mmap(nullptr, (HU_STACK_MAX_IDS / 64) * sizeof(std::atomic<uint64_t>), PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (mem == MAP_FAILED) return false;
+
+  hu_trace_stacks_written = (std::atomic<uint64_t>*)mem;
+  hu_trace_write_mutex = new std::mutex();
+  hu_trace_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+  if (hu_trace_fd == -1) return false;
+
+  hu_trace_pid = getpid();
+  hu_trace_start_time = hu_trace_time();
+  hu_trace_write((const unsigned char*)HU_TRACE_MAGIC, HU_TRACE_MAGIC_LEN);
+  return true;
+}
+
+void hu_trace_event(int event, void* ptr, size_t size, uint32_t callstack_id)
+{
+  hu_trace_buffer* buffer = hu_trace_owner.buffer;
+  if (buffer == nullptr)
+  {
+    buffer = hu_trace_owner.buffer = hu_trace_buffer_acquire();
+    if (buffer == nullptr) return;
+  }
+
+  const uint64_t time = hu_trace_time();
+  std::lock_guard<std::mutex> lock(buffer->mutex);
+  if ((HU_TRACE_BUFFER_SIZE - buffer->len) < HU_TRACE_RECORD_MAX)
+  {
+    hu_trace_buffer_flush(buffer);
+  }
+
+  unsigned char* out = buffer->data + buffer->len;
+  if ((callstack_id != HU_STACK_ID_NONE) && hu_trace_stack_claim(callstack_id))
+  {
+    void* const* callstack = nullptr;
+    int callstack_depth = hu_stack_get(callstack_id, &callstack);
+    *out++ = HU_TRACE_REC_STACK;
+    out = hu_trace_put(out, callstack_id);
+    out = hu_trace_put(out, callstack_depth);
+    for (int i = 0; i < callstack_depth; ++i)
+    {
+      out = hu_trace_put(out, (uintptr_t)callstack[i]);
+    }
+  }
+
+  *out++ = (unsigned char)event;
+  out = hu_trace_put(out, buffer->thread);
+  out = hu_trace_put(out, (time > buffer->last_time) ? (time - buffer->last_time) : 0);
+  out = hu_trace_put(out, (uintptr_t)ptr);
+  if (event != EVENT_FREE)
+  {
+    out = hu_trace_put(out, size);
+    out = hu_trace_put(out, callstack_id);
+  }
+
+  buffer->last_time = std::max(time, buffer->last_time);
+  buffer->len = out - buffer->data;
+  hu_trace_events.fetch_add(1, std::memory_order_relaxed);
+}
+
+void hu_trace_module(uintptr_t start, uintptr_t end, uintptr_t base, const char* build_id, const char* path)
+{
+  const size_t build_id_len = strlen(build_id);
+  const size_t path_len = strlen(path);
+  if ((build_id_len + path_len + 64) > HU_TRACE_MODULE_MAX) return;
+
+  unsigned char record[HU_TRACE_MODULE_MAX];
+  unsigned char* out = record;
+  *out++ = HU_TRACE_REC_MODULE;
+  out = hu_trace_put(out, start);
+  out = hu_trace_put(out, end);
+  out = hu_trace_put(out, base);
+  out = hu_trace_put(out, build_id_len);
+  memcpy(out, build_id, build_id_len);
+  out += build_id_len;
+  out = hu_trace_put(out, path_len);
+  memcpy(out, path, path_len);
+  out += path_len;
+  hu_trace_write(record, out - record);
+}
+
+/*
+ * hu_trace_flush writes out the buffered records of all threads.
+ */
+void hu_trace_flush()
+{
+  for (hu_trace_buffer* buffer = hu_trace_buffers.load(std::memory_order_acquire); buffer != nullptr;
+       buffer = buffer->next)
+  {
+    std::lock_guard<std::mutex> lock(buffer->mutex);
+    hu_trace_buffer_flush(buffer);
+  }
+}
+
+unsigned long long hu_trace_event_count()
+{
+  return hu_trace_events.load(std::memory_order_relaxed);
+}
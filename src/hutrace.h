@@ -0,0 +1,43 @@
+/*
+ * hutrace.h
+ *
+ * Copyright (C) 2026 Kristofer Berggren
+ * All rights reserved.
+ *
+ * heapusage is distributed under the BSD 3-Clause license, see LICENSE for details.
+ *
+ */
+
+#pragma once
+
+/* ----------- Includes ------------------------------------------ */
+#include <cstddef>
+#include <cstdint>
+
+
+/* ----------- Defines ------------------------------------------- */
+/*
+ * Trace file format. The file starts with HU_TRACE_MAGIC followed by records,
+ * each a record type byte and unsigned LEB128 encoded fields:
+ *   EVENT_MALLOC/CALLOC/REALLOC  thread, time delta, ptr, size, stack id
+ *   EVENT_FREE                   thread, time delta, ptr
+ *   HU_TRACE_REC_STACK           stack id, depth, frames
+ *   HU_TRACE_REC_MODULE          start, end, base, build-id, path (strings
+ *                                as length and bytes)
+ * Time is in nanoseconds, relative to the previous event of the same thread.
+ * Records of a thread are in order, while threads' records are interleaved
+ * in blocks. Stacks are written once, before their first use in the writing
+ * thread, but may appear after use by other threads.
+ */
+#define HU_TRACE_MAGIC "HUTRACE1"
+#define HU_TRACE_MAGIC_LEN 8
+#define HU_TRACE_REC_STACK 16
+#define HU_TRACE_REC_MODULE 17
+
+
+/* ----------- Global Function Prototypes ------------------------ */
+bool hu_trace_init(const char* path);
+void hu_trace_event(int event, void* ptr, size_t size, uint32_t callstack_id);
+void hu_trace_module(uintptr_t start, uintptr_t end, uintptr_t base, const char* build_id, const char* path);
+void hu_trace_flush();
+unsigned long long hu_trace_event_count();
@@ -0,0 +1,196 @@
+/*
+ * huunwind.cpp
+ *
+ * Copyright (C) 2026 Kristofer Berggren
+ * All rights reserved.
+ *
+ * heapusage is distributed under the BSD 3-Clause license, see LICENSE for details.
+ *
+ */
+
+/* ----------- Includes ------------------------------------------ */
+#include <cstdint>
+#include <cstdio>
+
+#include <execinfo.h>
+#include <pthread.h>
+
+#include "huunwind.h"
+
+
+/* ----------- Defines ------------------------------------------- */
+#define HU_UNWIND_MAX_FRAMES 256   /* Upper limit for max_depth */
+#define HU_UNWIND_OUTER_FRAMES 2   /* Frames without frame pointer at bottom of stack */
+
+
+/* ----------- File Global Variables ----------------------------- */
+#if defined(HU_UNWIND_FP)
+static bool hu_unwind_fp = false;
+static thread_local uintptr_t hu_unwind_stack_top = 0;
+static thread_local uintptr_t hu_unwind_outer_frame = 0;
+#endif
+
+
+/* ----------- Local Functions ----------------------------------- */
+#if defined(HU_UNWIND_FP)
+static uintptr_t hu_unwind_get_stack_top()
+{
+  uintptr_t top = 0;
+#if defined(__APPLE__)
+  top = (uintptr_t)pthread_get_stackaddr_np(pthread_self());
+#else
+  pthread_attr_t attr;
+  if (pthread_getattr_np(pthread_self(), &attr) == 0)
+  {
+    void* addr = nullptr;
+    size_t size = 0;
+    if (pthread_attr_getstack(&attr, &addr, &size) == 0)
+    {
+      top = (uintptr_t)addr + size;
+    }
+
+    pthread_attr_destroy(&attr);
+  }
+#endif
+
+  return top;
+}
+
+/*
+ * hu_unwind_frames walks the frame pointer chain, where each frame starts
+ * with the caller's frame pointer followed by the return address. Frame
+ * pointers are only followed while they are aligned and strictly increasing
+ * between the current frame and the top of the thread's stack, so that no
+ * unmapped memory is read. If the chain breaks, which happens at a function
+ * built without frame pointers, the frame it broke at is set in broken.
+ * Returns -1 if the stack bounds are unknown.
+ */
+static int __attribute__((noinline)) hu_unwind_frames(void** callstack, int max_depth, uintptr_t* broken)
+{
+  if (hu_unwind_stack_top == 0)
+  {
+    /* Unknown stack bounds are cached as an empty stack, always falling back */
+    hu_unwind_stack_top = hu_unwind_get_stack_top();
+    if (hu_unwind_stack_top == 0)
+    {
+      hu_unwind_stack_top = 1;
+    }
+  }
+
+  uintptr_t* frame = (uintptr_t*)__builtin_frame_address(0);
+  uintptr_t* const top = (uintptr_t*)hu_unwind_stack_top;
+  if ((frame + 2) > top) return -1;
+
+  /* Return address into hu_unwind() is skipped, its caller is entry zero */
+  int depth = 0;
+  int skip = 1;
+  *broken = 0;
+  while (depth < max_depth)
+  {
+    uintptr_t* next = (uintptr_t*)frame[0];
+    void* ret = (void*)frame[1];
+    if (ret == nullptr) break;
+
+    if (skip > 0)
+    {
+      --skip;
+    }
+    else
+    {
+      callstack[depth++] = ret;
+    }
+
+    /* Regular end of chain, the outermost frame pointer is null */
+    if (next == nullptr) break;
+
+    if ((next <= frame) || ((next + 2) > top) || (((uintptr_t)next % sizeof(void*)) != 0))
+    {
+      *broken = (uintptr_t)frame;
+      break;
+    }
+
+    frame = next;
+  }
+
+  return depth;
+}
+
+/*
+ * hu_unwind_is_outer checks whether a frame pointer chain that broke is only
+ * missing the outermost frames of the thread, compared to the full stack
+ * from backtrace(). These are typically in libc (thread start or program
+ * entry) built without frame pointers.
+ */
+static bool hu_unwind_is_outer(void* const* callstack, int depth, void* const* frames, int frames_depth)
+{
+  if ((frames_depth < depth) || ((frames_depth - depth) > HU_UNWIND_OUTER_FRAMES)) return false;
+
+  for (int i = 0; i < depth; ++i)
+  {
+    if (callstack[i] != frames[i]) return false;
+  }
+
+  return true;
+}
+#endif
+
+
+/* ----------- Global Functions ---------------------------------- */
+void hu_unwind_init(bool fp)
+{
+#if defined(HU_UNWIND_FP)
+  hu_unwind_fp = fp;
+#else
+  if (fp)
+  {
+    fprintf(stderr, "heapusage warning: built without frame pointer unwinder, using backtrace()\n");
+  }
+#endif
+}
+
+/*
+ * hu_unwind captures the callstack of its caller, with the first entry being
+ * a return address into the caller itself, as with backtrace() called
+ * directly from there.
+ */
+int __attribute__((noinline)) hu_unwind(void** callstack, int max_depth)
+{
+  if (max_depth > HU_UNWIND_MAX_FRAMES)
+  {
+    max_depth = HU_UNWIND_MAX_FRAMES;
+  }
+
+#if defined(HU_UNWIND_FP)
+  /*
+   * A chain breaking at a frame known to be the outermost one with a frame
+   * pointer is complete. Otherwise, as it would end with a truncated stack,
+   * backtrace() is used, and the frame is known to be outermost if that
+   * only adds the last few frames.
+   */
+  int fp_depth = -1;
+  uintptr_t broken = 0;
+  if (hu_unwind_fp)
+  {
+    fp_depth = hu_unwind_frames(callstack, max_depth, &broken);
+    if ((fp_depth > 0) && ((broken == 0) || (broken == hu_unwind_outer_frame))) return fp_depth;
+  }
+#endif
+
+  /* Skip own frame, so that the first entry is in the caller */
+  void* frames[HU_UNWIND_MAX_FRAMES + 1];
+  int depth = backtrace(frames, max_depth + 1);
+
+#if defined(HU_UNWIND_FP)
+  if ((fp_depth > 0) && (depth <= max_depth) && hu_unwind_is_outer(callstack, fp_depth, frames + 1, depth - 1))
+  {
+    hu_unwind_outer_frame = broken;
+  }
+#endif
+
+  for (int i = 1; i < depth; ++i)
+  {
+    callstack[i - 1] = frames[i];
+  }
+
+  return (depth > 0) ? (depth - 1) : 0;
+}
@@ -0,0 +1,15 @@
+/*
+ * huunwind.h
+ *
+ * Copyright (C) 2026 Kristofer Berggren
+ * All rights reserved.
+ *
+ * heapusage is distributed under the BSD 3-Clause license, see LICENSE for details.
+ *
+ */
+
+#pragma once
+
+/* ----------- Global Function Prototypes ------------------------ */
+void hu_unwind_init(bool fp);
+int hu_unwind(void** callstack, int max_depth);
@@ -0,0 +1,250 @@
+/*
+ * huwriter.cpp
+ *
+ * Copyright (C) 2026 Kristofer Berggren
+ * All rights reserved.
+ *
+ * heapusage is distributed under the BSD 3-Clause license, see LICENSE for details.
+ *
+ */
+
+/* ----------- Includes ------------------------------------------ */
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "huwriter.h"
+
+
+/* ----------- Defines ------------------------------------------- */
+#define HU_WRITER_BUFFER_SIZE (64 * 1024)   /* Output buffered before write() */
+
+
+/* ----------- File Global Variables ----------------------------- */
+/*
+ * Log output goes through a single descriptor, kept open for the lifetime of
+ * the process, and a statically allocated buffer. Formatting supports the
+ * printf subset used by heapusage without allocating or calling stdio, so it
+ * is async-signal-safe. Not thread-safe; callers serialize output, and flush
+ * at the end of each report.
+ */
+static int hu_writer_fd = -1;
+static char hu_writer_buffer[HU_WRITER_BUFFER_SIZE];
+static size_t hu_writer_len = 0;
+
+
+/* ----------- Local Functions ----------------------------------- */
+static void hu_writer_write(const char* data, size_t len)
+{
+  while (len > 0)
+  {
+    ssize_t rv = write(hu_writer_fd, data, len);
+    if (rv < 0)
+    {
+      if (errno == EINTR) continue;
+
+      return;
+    }
+
+    data += rv;
+    len -= rv;
+  }
+}
+
+static inline void hu_writer_putc(char c)
+{
+  if (hu_writer_len == HU_WRITER_BUFFER_SIZE)
+  {
+    hu_writer_flush();
+  }
+
+  hu_writer_buffer[hu_writer_len++] = c;
+}
+
+static void hu_writer_puts(const char* str, int width)
+{
+  int len = (int)strlen(str);
+  for (; width > len; --width)
+  {
+    hu_writer_putc(' ');
+  }
+
+  for (const char* p = str; *p; ++p)
+  {
+    hu_writer_putc(*p);
+  }
+}
+
+static void hu_writer_putnum(unsigned long long value, unsigned base, bool negative, int width, bool zero_pad)
+{
+  static const char digits[] = "0123456789abcdef";
+  char str[24];
+  int len = 0;
+  do
+  {
+    str[len++] = digits[value % base];
+    value /= base;
+  }
+  while (value != 0);
+
+  const int total = len + (negative ? 1 : 0);
+  if (!zero_pad)
+  {
+    for (; width > total; --width)
+    {
+      hu_writer_putc(' ');
+    }
+  }
+
+  if (negative)
+  {
+    hu_writer_putc('-');
+  }
+
+  if (zero_pad)
+  {
+    for (; width > total; --width)
+    {
+      hu_writer_putc('0');
+    }
+  }
+
+  while (len > 0)
+  {
+    hu_writer_putc(str[--len]);
+  }
+}
+
+
+/* ----------- Global Functions ---------------------------------- */
+bool hu_writer_open(const char* path)
+{
+  hu_writer_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+  return (hu_writer_fd != -1);
+}
+
+bool hu_writer_is_open()
+{
+  return (hu_writer_fd != -1);
+}
+
+void hu_writer_printf(const char* format, ...)
+{
+  va_list args;
+  va_start(args, format);
+  hu_writer_vprintf(format, args);
+  va_end(args);
+}
+
+/*
+ * Supports conversions d, i, u, x, p, s, c and %, with optional zero padding,
+ * field width and length modifiers l, ll and z.
+ */
+void hu_writer_vprintf(const char* format, va_list args)
+{
+  if (hu_writer_fd == -1) return;
+
+  for (const char* p = format; *p; ++p)
+  {
+    if (*p != '%')
+    {
+      hu_writer_putc(*p);
+      continue;
+    }
+
+    ++p;
+    bool zero_pad = false;
+    if (*p == '0')
+    {
+      zero_pad = true;
+      ++p;
+    }
+
+    int width = 0;
+    for (; (*p >= '0') && (*p <= '9'); ++p)
+    {
+      width = (width * 10) + (*p - '0');
+    }
+
+    /* Length in number of l's, size_t taken to be long */
+    int length = 0;
+    for (; (*p == 'l') || (*p == 'z'); ++p)
+    {
+      ++length;
+    }
+
+    switch (*p)
+    {
+      case 'd':
+      case 'i':
+      {
+        long long value = (length >= 2) ? va_arg(args, long long) :
+          (length == 1) ? va_arg(args, long) : va_arg(args, int);
+        unsigned long long magnitude = (value < 0) ? (0ULL - (unsigned long long)value) : value;
+        hu_writer_putnum(magnitude, 10, (value < 0), width, zero_pad);
+        break;
+      }
+
+      case 'u':
+      case 'x':
+      {
+        unsigned long long value = (length >= 2) ? va_arg(args, unsigned long long) :
+          (length == 1) ? va_arg(args, unsigned long) : va_arg(args, unsigned int);
+        hu_writer_putnum(value, (*p == 'x') ? 16 : 10, false, width, zero_pad);
+        break;
+      }
+
+      case 'p':
+      {
+        void* value = va_arg(args, void*);
+        if (value == nullptr)
+        {
+          hu_writer_puts("(nil)", width);
+        }
+        else
+        {
+          hu_writer_putc('0');
+          hu_writer_putc('x');
+          hu_writer_putnum((uintptr_t)value, 16, false, 0, false);
+        }
+        break;
+      }
+
+      case 's':
+      {
+        const char* value = va_arg(args, const char*);
+        hu_writer_puts((value != nullptr) ? value : "(null)", width);
+        break;
+      }
+
+      case 'c':
+        hu_writer_putc((char)va_arg(args, int));
+        break;
+
+      case '%':
+        hu_writer_putc('%');
+        break;
+
+      case '\0':
+        return;
+
+      default:
+        hu_writer_putc('%');
+        hu_writer_putc(*p);
+        break;
+    }
+  }
+}
+
+void hu_writer_flush()
+{
+  if ((hu_writer_fd != -1) && (hu_writer_len > 0))
+  {
+    hu_writer_write(hu_writer_buffer, hu_writer_len);
+  }
+
+  hu_writer_len = 0;
+}
@@ -0,0 +1,23 @@
+/*
+ * huwriter.h
+ *
+ * Copyright (C) 2026 Kristofer Berggren
+ * All rights reserved.
+ *
+ * heapusage is distributed under the BSD 3-Clause license, see LICENSE for details.
+ *
+ */
+
+#pragma once
+
+/* ----------- Includes ------------------------------------------ */
+#include <cstdarg>
+#include <cstddef>
+
+
+/* ----------- Global Function Prototypes ------------------------ */
+bool hu_writer_open(const char* path);
+bool hu_writer_is_open();
+void hu_writer_printf(const char* format, ...) __attribute__ ((format (printf, 1, 2)));
+void hu_writer_vprintf(const char* format, va_list args);
+void hu_writer_flush();
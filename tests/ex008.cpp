@@ -0,0 +1,56 @@
+/*
+ * ex008.cpp
+ *
+ * Copyright (C) 2026 Kristofer Berggren
+ * All rights reserved.
+ *
+ * heapusage is distributed under the BSD 3-Clause license, see LICENSE for details.
+ *
+ */
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+#include <vector>
+
+static void worker(int iterations)
+{
+  void* ptrs[16] = { 0 };
+  for (int i = 0; i < iterations; ++i)
+  {
+    int slot = i % 16;
+    free(ptrs[slot]);
+    ptrs[slot] = malloc(16 + (i % 64));
+  }
+
+  for (int slot = 0; slot < 16; ++slot)
+  {
+    free(ptrs[slot]);
+  }
+}
+
+int main(int argc, char* argv[])
+{
+  int threads = (argc > 1) ? atoi(argv[1]) : 8;
+  int iterations = (argc > 2) ? atoi(argv[2]) : 100000;
+
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+  std::vector<std::thread> workers;
+  for (int i = 0; i < threads; ++i)
+  {
+    workers.emplace_back(worker, iterations);
+  }
+
+  for (auto& thread : workers)
+  {
+    thread.join();
+  }
+
+  std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+  long long elapsed_ms = std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count();
+  printf("%d threads x %d iterations: %lld ms\n", threads, iterations, elapsed_ms);
+
+  return 0;
+}
@@ -0,0 +1,34 @@
+/*
+ * ex009.cpp
+ *
+ * Copyright (C) 2026 Kristofer Berggren
+ * All rights reserved.
+ *
+ * heapusage is distributed under the BSD 3-Clause license, see LICENSE for details.
+ *
+ */
+
+#include <cstdio>
+#include <cstdlib>
+
+static void* leak(size_t size)
+{
+  return malloc(size);
+}
+
+int main(int argc, char** argv)
+{
+  int count = (argc > 1) ? atoi(argv[1]) : 10000;
+  size_t size = (argc > 2) ? strtoul(argv[2], nullptr, 10) : 1000;
+
+  /* Leak count blocks of size bytes, and free as many from another call site */
+  for (int i = 0; i < count; ++i)
+  {
+    void* ptr = malloc(size);
+    if (leak(size) == nullptr) return 1;
+    free(ptr);
+  }
+
+  printf("%d x %zu bytes leaked\n", count, size);
+  return 0;
+}
@@ -0,0 +1,25 @@
+/*
+ * ex010.cpp
+ *
+ * Copyright (C) 2026 Kristofer Berggren
+ * All rights reserved.
+ *
+ * heapusage is distributed under the BSD 3-Clause license, see LICENSE for details.
+ *
+ */
+
+#include <cstdlib>
+
+int main()
+{
+  char* a = (char*)malloc(4096);
+  char* b = (char*)malloc(4096);
+
+  // heap-buffer-underflow write
+  b[-1] = 'x';
+
+  free(a);
+  free(b);
+
+  return 0;
+}
@@ -0,0 +1,37 @@
+/*
+ * ex011.cpp
+ *
+ * Copyright (C) 2026 Kristofer Berggren
+ * All rights reserved.
+ *
+ * heapusage is distributed under the BSD 3-Clause license, see LICENSE for details.
+ *
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+int main(int argc, char** argv)
+{
+  unsigned long long total = (argc > 1) ? strtoull(argv[1], nullptr, 10) : (64ULL << 20);
+  const size_t large_size = 1 << 20;
+
+  char* s = (char*)malloc(100);
+  strcpy(s, "hello world");
+  free(s);
+
+  /* Free more large blocks than fit in the quarantine */
+  for (unsigned long long freed = 0; freed < total; freed += large_size)
+  {
+    char* p = (char*)malloc(large_size);
+    p[0] = 1;
+    free(p);
+  }
+
+  // use-after-free read
+  char c = s[4];
+  (void)c;
+
+  return 0;
+}
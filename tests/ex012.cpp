@@ -0,0 +1,38 @@
+/*
+ * ex012.cpp
+ *
+ * Copyright (C) 2026 Kristofer Berggren
+ * All rights reserved.
+ *
+ * heapusage is distributed under the BSD 3-Clause license, see LICENSE for details.
+ *
+ */
+
+/* ----------- Includes ------------------------------------------ */
+#include <cstdlib>
+
+
+/* ----------- Defines ------------------------------------------- */
+#define BLOCK_COUNT 1000
+
+
+/* ----------- Global Functions ---------------------------------- */
+int main()
+{
+  /* Allocate and free a number of blocks */
+  void* ptrs[BLOCK_COUNT];
+  for (int i = 0; i < BLOCK_COUNT; ++i)
+  {
+    ptrs[i] = malloc(64);
+  }
+
+  for (int i = 0; i < BLOCK_COUNT; ++i)
+  {
+    free(ptrs[i]);
+  }
+
+  /* Free first block again (double free), after all others were free'd */
+  free(ptrs[0]);
+
+  return 0;
+}
@@ -0,0 +1,46 @@
+/*
+ * ex013.cpp
+ *
+ * Copyright (C) 2026 Kristofer Berggren
+ * All rights reserved.
+ *
+ * heapusage is distributed under the BSD 3-Clause license, see LICENSE for details.
+ *
+ */
+
+/* ----------- Includes ------------------------------------------ */
+#include <cstdlib>
+#include <new>
+
+
+/* ----------- Global Functions ---------------------------------- */
+int main()
+{
+  /* Matching allocation and deallocation, including sized and aligned */
+  char* str = new char[16];
+  delete[] str;
+
+  int* num = new int;
+  ::operator delete(num, sizeof(int));
+
+  void* aligned = ::operator new(64, std::align_val_t(64));
+  ::operator delete(aligned, std::align_val_t(64));
+
+  /* Array allocated by new[] deleted by delete */
+  int* nums = new int[8];
+  delete nums;
+
+  /* Block allocated by malloc() deleted by delete */
+  void* ptr = malloc(24);
+  ::operator delete(ptr);
+
+  /* Block allocated by new free'd by free() */
+  double* dbl = new double;
+  free(dbl);
+
+  /* Sized delete with wrong size */
+  void* buf = ::operator new(40);
+  ::operator delete(buf, 32);
+
+  return 0;
+}
@@ -0,0 +1,74 @@
+/*
+ * ex014.c
+ *
+ * Copyright (C) 2026 Kristofer Berggren
+ * All rights reserved.
+ *
+ * heapusage is distributed under the BSD 3-Clause license, see LICENSE for details.
+ *
+ */
+
+/* ----------- Includes ------------------------------------------ */
+#define _GNU_SOURCE
+#include <malloc.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+
+/* ----------- Local Functions ----------------------------------- */
+static void check_aligned(const char* name, void* ptr, size_t alignment)
+{
+  if ((ptr == NULL) || (((uintptr_t)ptr % alignment) != 0))
+  {
+    printf("%s returned misaligned block %p\n", name, ptr);
+  }
+}
+
+
+/* ----------- Global Functions ---------------------------------- */
+int main(int argc, char** argv)
+{
+  const size_t page_size = (size_t)getpagesize();
+
+  /* Aligned allocations of each kind */
+  void* ptr = NULL;
+  if (posix_memalign(&ptr, 256, 1000) != 0)
+  {
+    ptr = NULL;
+  }
+  check_aligned("posix_memalign", ptr, 256);
+  if (malloc_usable_size(ptr) < 1000)
+  {
+    printf("malloc_usable_size returned %zu\n", malloc_usable_size(ptr));
+  }
+
+  void* big = aligned_alloc(2 * page_size, 5000);
+  check_aligned("aligned_alloc", big, 2 * page_size);
+
+  void* lost = memalign(32, 77);
+  check_aligned("memalign", lost, 32);
+
+  void* page = valloc(10);
+  check_aligned("valloc", page, page_size);
+
+  void* pages = pvalloc(10);
+  check_aligned("pvalloc", pages, page_size);
+
+  free(ptr);
+  free(big);
+  free(page);
+  free(pages);
+
+  /* Write just past end of aligned block (overflow) */
+  (void)argv;
+  if (argc > 1)
+  {
+    char* buf = aligned_alloc(64, 128);
+    buf[128] = 'x';
+    free(buf);
+  }
+
+  return 0;
+}
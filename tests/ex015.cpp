@@ -0,0 +1,52 @@
+/*
+ * ex015.cpp
+ *
+ * Copyright (C) 2026 Kristofer Berggren
+ * All rights reserved.
+ *
+ * heapusage is distributed under the BSD 3-Clause license, see LICENSE for details.
+ *
+ */
+
+/* ----------- Includes ------------------------------------------ */
+#include <cstdlib>
+
+
+/* ----------- Defines ------------------------------------------- */
+#define BLOCK_COUNT 64
+#define BLOCK_SIZE (64 * 1024)
+
+
+/* ----------- Local Functions ----------------------------------- */
+static void __attribute__ ((noinline)) grow_heap(void** ptrs)
+{
+  for (int i = 0; i < BLOCK_COUNT; ++i)
+  {
+    ptrs[i] = malloc(BLOCK_SIZE);
+  }
+}
+
+static void __attribute__ ((noinline)) churn_heap()
+{
+  for (int i = 0; i < (4 * BLOCK_COUNT); ++i)
+  {
+    free(malloc(BLOCK_SIZE));
+  }
+}
+
+
+/* ----------- Global Functions ---------------------------------- */
+int main()
+{
+  /* Grow heap to 4 MB, shrink it, then allocate without growing it */
+  void* ptrs[BLOCK_COUNT];
+  grow_heap(ptrs);
+  for (int i = 0; i < BLOCK_COUNT; ++i)
+  {
+    free(ptrs[i]);
+  }
+
+  churn_heap();
+
+  return 0;
+}